@@ -12,15 +12,46 @@ const char *ocl_code = R"_mrb_(
 #define ARGON2_ID 2
 #define ARGON2_TYPE ARGON2_ID
 
-enum algo_params {
-    ALGO_LANES = 1,
-    ALGO_MCOST = 1,
-    ALGO_PASSES = 1,
-    ALGO_OUTLEN = 32,
-    ALGO_TOTAL_BLOCKS = (ALGO_MCOST / (4 * ALGO_LANES)) * 4 * ALGO_LANES,
-    ALGO_LANE_LENGHT = ALGO_TOTAL_BLOCKS / ALGO_LANES,
-    ALGO_SEGMENT_BLOCKS = ALGO_LANE_LENGHT / 4
-};
+// argon2 params, host passes the active ones with -D, defaults are HF7
+#ifndef ALGO_LANES
+#define ALGO_LANES 1
+#endif
+#ifndef ALGO_MCOST
+#define ALGO_MCOST 1
+#endif
+#ifndef ALGO_PASSES
+#define ALGO_PASSES 1
+#endif
+#define ALGO_OUTLEN 32
+// argon2 uses at least 2 blocks per segment, memory is rounded down to a multiple of 4 * lanes blocks
+#define ALGO_MIN_BLOCKS (2 * ARGON2_SYNC_POINTS * ALGO_LANES)
+#define ALGO_SEGMENT_BLOCKS ((ALGO_MCOST > ALGO_MIN_BLOCKS ? ALGO_MCOST : ALGO_MIN_BLOCKS) / (ARGON2_SYNC_POINTS * ALGO_LANES))
+#define ALGO_LANE_LENGTH (ALGO_SEGMENT_BLOCKS * ARGON2_SYNC_POINTS)
+#define ALGO_TOTAL_BLOCKS (ALGO_LANE_LENGTH * ALGO_LANES)
+
+// global argon memory, addressed in qwords: a block is a pointer to its qword 0, qword q at q * MEM_STRIDE
+// default: blocks of a nonce are contiguous
+// INTERLEAVED_MEMORY: qwords of INTERLEAVE_NONCES consecutive nonces are interleaved, so neighbour
+// work items of search & search2 access neighbour addresses (batch size must be a multiple)
+#ifdef INTERLEAVED_MEMORY
+#ifndef INTERLEAVE_NONCES
+#define INTERLEAVE_NONCES 32
+#endif
+#define MEM_STRIDE INTERLEAVE_NONCES
+#define NONCE_MEM(memory, n) ((memory) + ((size_t)(n) / INTERLEAVE_NONCES) * ALGO_TOTAL_BLOCKS * ARGON2_QWORDS_IN_BLOCK * INTERLEAVE_NONCES + (n) % INTERLEAVE_NONCES)
+#else
+#define MEM_STRIDE 1
+#define NONCE_MEM(memory, n) ((memory) + (size_t)(n) * ALGO_TOTAL_BLOCKS * ARGON2_QWORDS_IN_BLOCK)
+#endif
+// block b after block mem
+#define BLOCK_MEM(mem, b) ((mem) + (size_t)(b) * ARGON2_QWORDS_IN_BLOCK * MEM_STRIDE)
+// 32 bits word w of a block
+#define BLOCK_WORD(w) (((w) >> 1) * MEM_STRIDE * 2 + ((w) & 1))
+
+// max winning nonces reported per batch
+#ifndef RESULT_SLOTS
+#define RESULT_SLOTS 15
+#endif
 
 typedef unsigned int uint32_t;
 typedef unsigned long uint64_t;
@@ -153,22 +184,12 @@ uint64_t rotate64( uint64_t x, const uint32_t n)
 {
     return (x >> n) | (x << (64 - n));
 }
-void blake2b_compress_loop_1w(  uint64_t* restrict state,__global struct block* memCell)
+// one blake2b of the long hash chain filling a first block, s is both input and output
+void blake2b_long_round(uint64_t* restrict s)
 {
     uint64_t v[16];
-    uint64_t s[8];
-    
-    s[0]=state[0];
-    s[1]=state[1];
-    s[2]=state[2];
-    s[3]=state[3];
-    s[4]=state[4];
-    s[5]=state[5];
-    s[6]=state[6];
-    s[7]=state[7];
-    
-    for (int i=1;i<31;i++){
-        initState(v);
+
+    initState(v);
     
     v[8]  = blake2b_IV[0];
     v[9]  = blake2b_IV[1];
@@ -1154,18 +1175,44 @@ void blake2b_compress_loop_1w(  uint64_t* restrict state,__global struct block*
     s[5] = blake2b_Init[5] ^ v[5] ^ v[13];
     s[6] = blake2b_Init[6] ^ v[6] ^ v[14];
     s[7] = blake2b_Init[7] ^ v[7] ^ v[15];
+}
+void blake2b_compress_loop_1w(  uint64_t* restrict state,__global uint64_t* memCell)
+{
+    uint64_t s[8];
+    
+    s[0]=state[0];
+    s[1]=state[1];
+    s[2]=state[2];
+    s[3]=state[3];
+    s[4]=state[4];
+    s[5]=state[5];
+    s[6]=state[6];
+    s[7]=state[7];
     
+    for (int i=1;i<31;i++){
+        blake2b_long_round(s);
     #pragma unroll
     for (int j=0;j<4;j++)
-            memCell->v[j+i*4]=s[j];
+            memCell[(j+i*4)*MEM_STRIDE]=s[j];
     }
     
     for (int i=0;i<4;i++)
-        memCell->v[i+124]=s[i+4];  
-
-
-
+        memCell[(i+124)*MEM_STRIDE]=s[i+4];  
+}
+void blake2b_compress_loop_local(uint64_t* restrict state, __local struct block* memCell)
+{
+    uint64_t s[8];
 
+    for (int j = 0; j < 8; j++)
+        s[j] = state[j];
+    for (int i = 1; i < 31; i++) {
+        blake2b_long_round(s);
+#pragma unroll
+        for (int j = 0; j < 4; j++)
+            memCell->v[j + i * 4] = s[j];
+    }
+    for (int i = 0; i < 4; i++)
+        memCell->v[i + 124] = s[i + 4];
 }
 
 void blake2b_compress_1w(
@@ -1257,45 +1304,59 @@ void computeInitialHash(
 
 }
 void fillFirstBlock(
-	__global struct block* memory,
+	__global uint64_t* memory,
 	uint32_t* buffer)
 {
 	
 	const uint32_t jobID = get_global_id(0); // *get_local_size(1) + get_local_id(1);
-	//uint32_t row = idx / ALGO_LANES;
-	//uint32_t column = idx % ALGO_LANES;
-	__global struct block* memCell = memory + (jobID * 8);
+	// blocks are stored row by row: block (row, lane) is at row * ALGO_LANES + lane
+	__global uint64_t* memJob = NONCE_MEM(memory, jobID);
 	uint64_t state[8];
-	initState(state);
 	buffer[0] = 1024;
-	buffer[17] = 0;
-	buffer[18] = 0;
 
-	blake2b_compress_1w(state, buffer, 1, true, 76);
+	for (uint32_t lane = 0; lane < ALGO_LANES; lane++) {
+		__global uint64_t* memCell = BLOCK_MEM(memJob, lane);
+		buffer[17] = 0;
+		buffer[18] = lane;
+		initState(state);
+		blake2b_compress_1w(state, buffer, 1, true, 76);
 
 #pragma unroll
-	for (int j = 0; j < 4; j++)
-		memCell->v[j] = state[j];
-	blake2b_compress_loop_1w(state, memCell); //ok in cpu - gpu verification
+		for (int j = 0; j < 4; j++)
+			memCell[j * MEM_STRIDE] = state[j];
+		blake2b_compress_loop_1w(state, memCell); //ok in cpu - gpu verification
 
-	memCell++;
-	buffer[17] = 1;
-	initState(state);
-	blake2b_compress_1w(state, buffer, 1, true, 76);
+		memCell = BLOCK_MEM(memCell, ALGO_LANES);
+		buffer[17] = 1;
+		initState(state);
+		blake2b_compress_1w(state, buffer, 1, true, 76);
 
 #pragma unroll
-	for (int j = 0; j < 4; j++)
-		memCell->v[j] = state[j];
-	blake2b_compress_loop_1w(state, memCell); //ok in cpu - gpu verification
-
-
+		for (int j = 0; j < 4; j++)
+			memCell[j * MEM_STRIDE] = state[j];
+		blake2b_compress_loop_1w(state, memCell); //ok in cpu - gpu verification
+	}
 }
+// batches are tagged with the epoch of their work, host bumps liveEpoch when work changes
+// so batches still queued for an older work exit right away
+#define BATCH_PREEMPTED() (*liveEpoch != batchEpoch)
+
+// same check for kernels with barriers, the whole work group must take the same path
+#define GROUP_PREEMPTED(flag) \
+	if (get_local_id(0) == 0 && get_local_id(1) == 0) \
+		flag = BATCH_PREEMPTED(); \
+	barrier(CLK_LOCAL_MEM_FENCE);
+
 __kernel void search(
-	__global struct block* memory,
+	__global uint64_t* memory,
 	__global uint32_t* input,
-	const ulong startNonce)
+	const ulong startNonce,
+	__global const volatile uint* liveEpoch,
+	const uint batchEpoch)
 {
-	
+	if (BATCH_PREEMPTED())
+		return;
+
 	uint32_t jobId = get_global_id(0) & 0xffffffff; // *get_local_size(1) + get_local_id(1);
 	const uint64_t nonce = startNonce + (jobId & 0xffffffff);
 	uint32_t buffer[32];
@@ -1306,6 +1367,19 @@ __kernel void search(
 
 } //search all{ works havent tested the nonce yet}
 
+// SUBGROUP_SHUFFLE is defined by host when the device has sub group shuffles,
+// the compiler may still not expose them (language version), local memory is used then
+#if defined(SUBGROUP_SHUFFLE) && defined(cl_intel_subgroups)
+#pragma OPENCL EXTENSION cl_intel_subgroups : enable
+#define HAS_SUB_GROUP_SHUFFLE
+#define sub_group_shuffle_u64(v, src) intel_sub_group_shuffle(v, src)
+#elif defined(SUBGROUP_SHUFFLE) && defined(cl_khr_subgroups) && defined(cl_khr_subgroup_shuffle)
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#pragma OPENCL EXTENSION cl_khr_subgroup_shuffle : enable
+#define HAS_SUB_GROUP_SHUFFLE
+#define sub_group_shuffle_u64(v, src) sub_group_shuffle(v, src)
+#endif
+
 struct u64_shuffle_buf {
     uint lo[THREADS_PER_LANE];
     uint hi[THREADS_PER_LANE];
@@ -1313,6 +1387,14 @@ struct u64_shuffle_buf {
 ulong u64_shuffle(ulong v, uint thread_src, uint thread,
                   __local struct u64_shuffle_buf *buf)
 {
+#ifdef HAS_SUB_GROUP_SHUFFLE
+    // no local memory & no barrier when each warp lies in one sub group (sub groups of 32, 64 ...)
+    // same size for the whole launch, so all work items take the same path
+    if (get_max_sub_group_size() % THREADS_PER_LANE == 0) {
+        uint warp_base = get_sub_group_local_id() - thread;
+        return sub_group_shuffle_u64(v, warp_base + thread_src);
+    }
+#endif
     uint lo = u64_lo(v);
     uint hi = u64_hi(v);
     buf->lo[thread] = lo;
@@ -1361,29 +1443,29 @@ void xor_block(struct block_th *dst, const struct block_th *src)
     dst->c ^= src->c;
     dst->d ^= src->d;
 }
-void load_block(struct block_th *dst, __global const struct block_g *src,
+void load_block(struct block_th *dst, __global const ulong *src,
                 uint thread)
 {
-    dst->a = src->data[0 * THREADS_PER_LANE + thread];
-    dst->b = src->data[1 * THREADS_PER_LANE + thread];
-    dst->c = src->data[2 * THREADS_PER_LANE + thread];
-    dst->d = src->data[3 * THREADS_PER_LANE + thread];
+    dst->a = src[(0 * THREADS_PER_LANE + thread) * MEM_STRIDE];
+    dst->b = src[(1 * THREADS_PER_LANE + thread) * MEM_STRIDE];
+    dst->c = src[(2 * THREADS_PER_LANE + thread) * MEM_STRIDE];
+    dst->d = src[(3 * THREADS_PER_LANE + thread) * MEM_STRIDE];
 }
-void load_block_xor(struct block_th *dst, __global const struct block_g *src,
+void load_block_xor(struct block_th *dst, __global const ulong *src,
                     uint thread)
 {
-    dst->a ^= src->data[0 * THREADS_PER_LANE + thread];
-    dst->b ^= src->data[1 * THREADS_PER_LANE + thread];
-    dst->c ^= src->data[2 * THREADS_PER_LANE + thread];
-    dst->d ^= src->data[3 * THREADS_PER_LANE + thread];
+    dst->a ^= src[(0 * THREADS_PER_LANE + thread) * MEM_STRIDE];
+    dst->b ^= src[(1 * THREADS_PER_LANE + thread) * MEM_STRIDE];
+    dst->c ^= src[(2 * THREADS_PER_LANE + thread) * MEM_STRIDE];
+    dst->d ^= src[(3 * THREADS_PER_LANE + thread) * MEM_STRIDE];
 }
-void store_block(__global struct block_g *dst, const struct block_th *src,
+void store_block(__global ulong *dst, const struct block_th *src,
                  uint thread)
 {
-    dst->data[0 * THREADS_PER_LANE + thread] = src->a;
-    dst->data[1 * THREADS_PER_LANE + thread] = src->b;
-    dst->data[2 * THREADS_PER_LANE + thread] = src->c;
-    dst->data[3 * THREADS_PER_LANE + thread] = src->d;
+    dst[(0 * THREADS_PER_LANE + thread) * MEM_STRIDE] = src->a;
+    dst[(1 * THREADS_PER_LANE + thread) * MEM_STRIDE] = src->b;
+    dst[(2 * THREADS_PER_LANE + thread) * MEM_STRIDE] = src->c;
+    dst[(3 * THREADS_PER_LANE + thread) * MEM_STRIDE] = src->d;
 }
 #ifdef cl_amd_media_ops
 #pragma OPENCL EXTENSION cl_amd_media_ops : enable
@@ -1561,13 +1643,13 @@ void compute_ref_pos(uint lanes, uint segment_blocks,
     }
 }
 void argon2_core(
-        __global struct block_g *memory, __global struct block_g *mem_curr,
+        __global ulong *memory, __global ulong *mem_curr,
         struct block_th *prev, struct block_th *tmp,
         __local struct u64_shuffle_buf *shuffle_buf, uint lanes,
         uint thread, uint pass, uint ref_index, uint ref_lane)
 {
-    __global struct block_g *mem_ref;
-    mem_ref = memory + ref_index * lanes + ref_lane;
+    __global ulong *mem_ref;
+    mem_ref = BLOCK_MEM(memory, ref_index * lanes + ref_lane);
 
 #if ALGO_VERSION == 0x10
     load_block_xor(prev, mem_ref, thread);
@@ -1618,12 +1700,13 @@ void next_addresses(struct block_th *addr, struct block_th *tmp,
 	xor_block(addr, tmp);
 
 }
-void argon2_step(
-        __global struct block_g *memory, __global struct block_g *mem_curr,
+// block referenced by the current step, shared by the global and on-chip fills
+void argon2_ref(
         struct block_th *prev, struct block_th *tmp, struct block_th *addr,
         __local struct u64_shuffle_buf *shuffle_buf,
         uint lanes, uint segment_blocks, uint thread, uint *thread_input,
-        uint lane, uint pass, uint slice, uint offset)
+        uint lane, uint pass, uint slice, uint offset,
+        uint *ref_index_out, uint *ref_lane_out)
 {
 	uint ref_index, ref_lane;
 	bool data_independent;
@@ -1657,28 +1740,95 @@ void argon2_step(
 
 	compute_ref_pos(lanes, segment_blocks, pass, lane, slice, offset,
 		&ref_lane, &ref_index);
-	data_independent = pass == 0 && slice ==0;
+	*ref_index_out = ref_index;
+	*ref_lane_out = ref_lane;
+}
+void argon2_step(
+        __global ulong *memory, __global ulong *mem_curr,
+        struct block_th *prev, struct block_th *tmp, struct block_th *addr,
+        __local struct u64_shuffle_buf *shuffle_buf,
+        uint lanes, uint segment_blocks, uint thread, uint *thread_input,
+        uint lane, uint pass, uint slice, uint offset)
+{
+	uint ref_index, ref_lane;
+	argon2_ref(prev, tmp, addr, shuffle_buf, lanes, segment_blocks, thread,
+		thread_input, lane, pass, slice, offset, &ref_index, &ref_lane);
 
-	if (!data_independent) {
+	argon2_core(memory, mem_curr, prev, tmp, shuffle_buf, lanes, thread, pass,
+		ref_index, ref_lane);
+}
 
-		
-		argon2_core(memory, mem_curr, prev, tmp, shuffle_buf, lanes, thread, pass,
-			ref_index, ref_lane);
-	}
+// on-chip fill: same steps, blocks of the nonce are kept in local memory
+void load_block_local(struct block_th *dst, __local const struct block_g *src,
+                      uint thread)
+{
+    dst->a = src->data[0 * THREADS_PER_LANE + thread];
+    dst->b = src->data[1 * THREADS_PER_LANE + thread];
+    dst->c = src->data[2 * THREADS_PER_LANE + thread];
+    dst->d = src->data[3 * THREADS_PER_LANE + thread];
+}
+void load_block_xor_local(struct block_th *dst, __local const struct block_g *src,
+                          uint thread)
+{
+    dst->a ^= src->data[0 * THREADS_PER_LANE + thread];
+    dst->b ^= src->data[1 * THREADS_PER_LANE + thread];
+    dst->c ^= src->data[2 * THREADS_PER_LANE + thread];
+    dst->d ^= src->data[3 * THREADS_PER_LANE + thread];
+}
+void store_block_local(__local struct block_g *dst, const struct block_th *src,
+                       uint thread)
+{
+    dst->data[0 * THREADS_PER_LANE + thread] = src->a;
+    dst->data[1 * THREADS_PER_LANE + thread] = src->b;
+    dst->data[2 * THREADS_PER_LANE + thread] = src->c;
+    dst->data[3 * THREADS_PER_LANE + thread] = src->d;
+}
+void argon2_core_local(
+        __local struct block_g *memory, __local struct block_g *mem_curr,
+        struct block_th *prev, struct block_th *tmp,
+        __local struct u64_shuffle_buf *shuffle_buf, uint lanes,
+        uint thread, uint pass, uint ref_index, uint ref_lane)
+{
+    __local struct block_g *mem_ref = memory + ref_index * lanes + ref_lane;
 
+#if ALGO_VERSION == 0x10
+    load_block_xor_local(prev, mem_ref, thread);
+    move_block(tmp, prev);
+#else
+    if (pass != 0) {
+        load_block_local(tmp, mem_curr, thread);
+        load_block_xor_local(prev, mem_ref, thread);
+        xor_block(tmp, prev);
+    } else {
+        load_block_xor_local(prev, mem_ref, thread);
+        move_block(tmp, prev);
+    }
+#endif
+
+    shuffle_block(prev, thread, shuffle_buf);
+    xor_block(prev, tmp);
+    store_block_local(mem_curr, prev, thread);
 }
 __kernel void search1(
         __local struct u64_shuffle_buf *shuffle_bufs,
-        __global struct block_g *memory, uint passes, uint lanes,
-        uint segment_blocks)
+        __global ulong *memory, uint passes, uint lanes,
+        uint segment_blocks,
+        __global const volatile uint* liveEpoch,
+        const uint batchEpoch)
 {
-	uint job_id = get_group_id(0);
-	uint lane =0;
+	__local uint preempted;
+	GROUP_PREEMPTED(preempted);
+	if (preempted)
+		return;
+
+	// one warp per lane, work group holds all lanes of one or more nonces
 	uint warp = get_local_id(0) / THREADS_PER_LANE;
+	uint job_id = get_group_id(0) * (get_local_size(0) / (THREADS_PER_LANE * lanes)) + warp / lanes;
+	uint lane = warp % lanes;
 	uint thread = get_local_id(0) % THREADS_PER_LANE;
 	__local struct u64_shuffle_buf *shuffle_buf = &shuffle_bufs[warp];
 	uint lane_blocks = ARGON2_SYNC_POINTS * segment_blocks;
-	memory += (size_t)job_id * lanes * lane_blocks;
+	memory = NONCE_MEM(memory, job_id);
 
 
 		struct block_th prev, addr, tmp;
@@ -1712,12 +1862,13 @@ __kernel void search1(
 			next_addresses(&addr, &tmp, thread_input, thread, shuffle_buf);
 		}
 
-		__global struct block_g *mem_lane = memory + lane;
-		__global struct block_g *mem_prev = mem_lane + 1 * lanes;
-		__global struct block_g *mem_curr = mem_lane + 2 * lanes;
+		__global ulong *mem_lane = BLOCK_MEM(memory, lane);
+		__global ulong *mem_prev = BLOCK_MEM(mem_lane, 1 * lanes);
+		__global ulong *mem_curr = BLOCK_MEM(mem_lane, 2 * lanes);
 
 		load_block(&prev, mem_prev, thread);
-		uint skip = 0;
+		// first 2 blocks of each lane are computed by search
+		uint skip = 2;
 
 
 
@@ -1731,11 +1882,11 @@ __kernel void search1(
 					argon2_step(memory, mem_curr, &prev, &tmp, &addr, shuffle_buf,
 						lanes, segment_blocks, thread, &thread_input,
 						lane, pass, slice, offset);
-					if (slice > 0)
-						mem_curr += lanes;
+					mem_curr = BLOCK_MEM(mem_curr, lanes);
 
 				}
-				barrier(CLK_LOCAL_MEM_FENCE);
+				// lanes sync at the end of each slice
+				barrier(CLK_GLOBAL_MEM_FENCE | CLK_LOCAL_MEM_FENCE);
 				if (thread == 2) {
 					++thread_input;
 				}
@@ -1748,6 +1899,112 @@ __kernel void search1(
 	
 		barrier(CLK_GLOBAL_MEM_FENCE);
 }
+
+// fill of one lane in local memory (blocks of one nonce), its first 2 blocks must be there
+// returns after the barrier of the last slice, with prev = last block of the lane
+void fill_local(
+        __local struct block_g *blocks, __local struct u64_shuffle_buf *shuffle_buf,
+        uint passes, uint lanes, uint segment_blocks, uint lane, uint thread,
+        struct block_th *prev)
+{
+	uint lane_blocks = ARGON2_SYNC_POINTS * segment_blocks;
+	struct block_th addr, tmp;
+	uint thread_input;
+
+	switch (thread) {
+	case 1:
+		thread_input = lane;
+		break;
+	case 3:
+		thread_input = lanes * lane_blocks;
+		break;
+	case 4:
+		thread_input = passes;
+		break;
+	case 5:
+		thread_input = ARGON2_TYPE;
+		break;
+	default:
+		thread_input = 0;
+		break;
+	}
+
+	if (segment_blocks > 2) {
+		if (thread == 6) {
+			++thread_input;
+		}
+		next_addresses(&addr, &tmp, thread_input, thread, shuffle_buf);
+	}
+
+	__local struct block_g *mem_lane = blocks + lane;
+	__local struct block_g *mem_curr = mem_lane + 2 * lanes;
+	load_block_local(prev, mem_lane + lanes, thread);
+	uint skip = 2;
+
+	for (uint pass = 0; pass < passes; ++pass) {
+		for (uint slice = 0; slice < ARGON2_SYNC_POINTS; ++slice) {
+			for (uint offset = 0; offset < segment_blocks; ++offset) {
+				if (skip > 0) {
+					--skip;
+					continue;
+				}
+				uint ref_index, ref_lane;
+				argon2_ref(prev, &tmp, &addr, shuffle_buf, lanes, segment_blocks,
+					thread, &thread_input, lane, pass, slice, offset, &ref_index, &ref_lane);
+				argon2_core_local(blocks, mem_curr, prev, &tmp, shuffle_buf, lanes,
+					thread, pass, ref_index, ref_lane);
+				mem_curr += lanes;
+			}
+			// lanes sync at the end of each slice
+			barrier(CLK_LOCAL_MEM_FENCE);
+			if (thread == 2) {
+				++thread_input;
+			}
+			if (thread == 6) {
+				thread_input = 0;
+			}
+		}
+		mem_curr = mem_lane;
+	}
+}
+
+// search1 with the argon memory of the work group's nonces in local memory (blocks, ALGO_TOTAL_BLOCKS per nonce)
+// first blocks are read from global memory, only the last block of each lane is written back for search2
+__kernel void search1_local(
+        __local struct u64_shuffle_buf *shuffle_bufs,
+        __global ulong *memory, uint passes, uint lanes,
+        uint segment_blocks,
+        __global const volatile uint* liveEpoch,
+        const uint batchEpoch,
+        __local struct block_g *blocks)
+{
+	__local uint preempted;
+	GROUP_PREEMPTED(preempted);
+	if (preempted)
+		return;
+
+	uint warp = get_local_id(0) / THREADS_PER_LANE;
+	uint job_local = warp / lanes;
+	uint job_id = get_group_id(0) * (get_local_size(0) / (THREADS_PER_LANE * lanes)) + job_local;
+	uint lane = warp % lanes;
+	uint thread = get_local_id(0) % THREADS_PER_LANE;
+	__local struct u64_shuffle_buf *shuffle_buf = &shuffle_bufs[warp];
+	uint lane_blocks = ARGON2_SYNC_POINTS * segment_blocks;
+	memory = NONCE_MEM(memory, job_id);
+	blocks += job_local * lanes * lane_blocks;
+
+	// first 2 blocks of each lane are computed by search
+	struct block_th prev;
+	load_block(&prev, BLOCK_MEM(memory, lane), thread);
+	store_block_local(blocks + lane, &prev, thread);
+	load_block(&prev, BLOCK_MEM(memory, lanes + lane), thread);
+	store_block_local(blocks + lanes + lane, &prev, thread);
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	fill_local(blocks, shuffle_buf, passes, lanes, segment_blocks, lane, thread, &prev);
+
+	store_block(BLOCK_MEM(memory, (lane_blocks - 1) * lanes + lane), &prev, thread);
+}
 void g_shuffle(
     const uint32_t r, 
     __local uint64_t* a, 
@@ -1771,7 +2028,14 @@ void load_block_fin( __global uint32_t* block, __local uint32_t* buffer, uint32_
     uint32_t i,j;
     for(i=0;i<64;i++){
         j=idx+i*4;
-        buffer[j]=block[j];
+        buffer[j]=block[BLOCK_WORD(j)];
+    }
+}
+void xor_block_fin( __global uint32_t* block, __local uint32_t* buffer, uint32_t idx){
+    uint32_t i,j;
+    for(i=0;i<64;i++){
+        j=idx+i*4;
+        buffer[j]^=block[BLOCK_WORD(j)];
     }
 }
 void blake2b_compress_final(
@@ -1829,27 +2093,110 @@ void blake2b_compress(
     state->a = state->a ^ buffer[idx] ^ buffer[idx+8];
     state->b = state->b ^ buffer[idx+4] ^ buffer[idx+12];
 }
+// blake2b_compress(_final) for work groups where only some work items hash, 4 per nonce (active)
+// every work item reaches the same barriers, which also separate the G steps of the 4 hashing ones
+void blake2b_compress_wg(
+    struct partialState* state,
+    __local uint64_t* m,
+    __local uint64_t* buffer,
+    uint32_t step,
+    uint32_t idx,
+    bool active,
+    bool last)
+{
+    if (active) {
+        buffer[idx]     = state->a;
+        buffer[idx+4]   = state->b;
+        buffer[idx+8]   = blake2b_IV[idx];
+        if (!last)
+            buffer[idx+12] = blake2b_IV[idx+4] ^ (idx == 0 ? step : 0) * BLAKE2B_BLOCKBYTES;
+        else if (idx == 0)
+            buffer[idx+12] = blake2b_IV[4] ^ (step-1)*BLAKE2B_BLOCKBYTES+4;
+        else if (idx == 2)
+            buffer[idx+12] = blake2b_IV[6] ^ (uint64_t) -1;
+        else
+            buffer[idx+12] = blake2b_IV[idx+4];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (uint32_t r = 0; r < 12; ++r) {
+        uint8_t ref1,ref2;
+        if (active) {
+            ref1 = sigma[r][0]>>16*idx;
+            ref2 = sigma[r][0]>>(16*idx+8);
+            g_shuffle(r, &buffer[idx], &buffer[idx+4], &buffer[idx+8], &buffer[idx+12], &m[ref1],&m[ref2] );
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (active) {
+            ref1=sigma[r][1]>>16*idx;
+            ref2=sigma[r][1]>>(16*idx+8);
+            g_shuffle(r, &buffer[idx], &buffer[(idx+1)%4 +4], &buffer[(idx+2)%4+8], &buffer[(idx+3)%4+12], &m[ref1],&m[ref2] );
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (active) {
+        state->a = state->a ^ buffer[idx] ^ buffer[idx+8];
+        state->b = state->b ^ buffer[idx+4] ^ buffer[idx+12];
+    }
+}
+
+// hash is 4 words, most significant first, as target
+void submit_if_below(
+	const uint64_t* hash,
+	__global const ulong* target,
+	__global uint64_t* output,
+	const uint64_t nonce)
+{
+	// winner if hash < target (same as host check)
+	bool below = false;
+	for (int i = 0; i < 4; i++) {
+		if (hash[i] != target[i]) {
+			below = hash[i] < target[i];
+			break;
+		}
+	}
+
+	if (below) {
+		// output[0] counts winners, followed by RESULT_SLOTS entries of nonce + 4 hash words
+		// count keeps growing past RESULT_SLOTS so host can detect overflow
+		uint slot = atomic_inc((__global uint*)output);
+		if (slot < RESULT_SLOTS) {
+			__global uint64_t* entry = &output[1 + slot * 5];
+			entry[0] = nonce;
+			for (int i = 0; i < 4; i++)
+				entry[1 + i] = hash[i];
+		}
+	}
+}
 
 __kernel void search2(
-	__global struct block* memory,
+	__global uint64_t* memory,
 	__global uint64_t* output,
 	__local uint64_t* smem,
 	const uint64_t startNonce,
-	const ulong target
-
+	__global const ulong* target,
+	__global const volatile uint* liveEpoch,
+	const uint batchEpoch
 )
 {
+	__local uint preempted;
+	GROUP_PREEMPTED(preempted);
+	if (preempted)
+		return;
+
 	uint32_t idx = get_local_id(0);
 	uint32_t jobId = get_group_id(1)*get_local_size(1) + get_local_id(1);
 	const uint64_t nonce = startNonce + jobId;
 
-	__global uint32_t* memLane = (__global uint32_t*)((memory + (jobId * 8)) + 7);
+	// final block is the xor of the last block of each lane
+	__global uint64_t* memLast = BLOCK_MEM(NONCE_MEM(memory, jobId), (ALGO_LANE_LENGTH - 1) * ALGO_LANES);
 	__local uint64_t* input = &smem[129 * get_local_id(1)];
 	__local uint64_t* buffer = (__local uint64_t*)&smem[129 * get_local_size(1) + get_local_id(1) * 18];
 	__local uint32_t* input_32 = (__local uint32_t*)input;
 
 
-	load_block_fin(memLane, &input_32[1], idx);
+	load_block_fin((__global uint32_t*)memLast, &input_32[1], idx);
+	for (uint32_t lane = 1; lane < ALGO_LANES; lane++)
+		xor_block_fin((__global uint32_t*)BLOCK_MEM(memLast, lane), &input_32[1], idx);
 
 	input_32[0] = 32;
 	struct partialState state;
@@ -1869,15 +2216,165 @@ __kernel void search2(
 
 	blake2b_compress_final(&state, &input[0], buffer, 9, idx);
 
+	// hash bytes are h[0..3] little endian, as a big endian 256 bits number word i is h[i] byte swapped
 	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int i = 0; i < 8; i++)
+		((__local uchar*)&input[idx])[i] = ((uchar*)&state.a)[7 - i];
+	barrier(CLK_LOCAL_MEM_FENCE);
+
 	if (idx == 0) {
-		ulong jim;
-		for (int i = 0; i < 8; i++)
-			((uchar*)&jim)[i] = ((uchar*)&state.a)[7 - i];
+		uint64_t hash[4];
+		for (int i = 0; i < 4; i++)
+			hash[i] = input[i];
+		submit_if_below(hash, target, output, nonce);
+	}
+}
 
-    if (jim <= target) {
-		output[0] = nonce; // SWAP4(nonce);
-		//printf("[gpu]winning hash = %llx \n", jim);
+// word w of the final block, xor of the last block of each lane
+uint32_t final_block_word(__global const uint64_t* memLast, uint32_t w)
+{
+	uint32_t x = ((__global const uint32_t*)memLast)[BLOCK_WORD(w)];
+	for (uint32_t lane = 1; lane < ALGO_LANES; lane++)
+		x ^= ((__global const uint32_t*)BLOCK_MEM(memLast, lane))[BLOCK_WORD(w)];
+	return x;
+}
+
+// search2 with one work item per nonce: the final hash stays in private memory, no barrier
+// (wide SIMD devices are underused by the 4 work items & barriers of search2)
+__kernel void search2_1w(
+	__global uint64_t* memory,
+	__global uint64_t* output,
+	const uint64_t startNonce,
+	__global const ulong* target,
+	__global const volatile uint* liveEpoch,
+	const uint batchEpoch)
+{
+	if (BATCH_PREEMPTED())
+		return;
+
+	uint32_t jobId = get_global_id(0) & 0xffffffff;
+	const uint64_t nonce = startNonce + jobId;
+	__global const uint64_t* memLast = BLOCK_MEM(NONCE_MEM(memory, jobId), (ALGO_LANE_LENGTH - 1) * ALGO_LANES);
+
+	// input is the output length (32) followed by the final block: 8 blake2b blocks + 4 bytes,
+	// each blake2b block starts with the last word of the previous one
+	uint64_t state[8];
+	uint32_t m[32];
+	for (int i = 0; i < 8; i++)
+		state[i] = blake2b_Init_928[i];
+	m[0] = 32;
+	for (uint32_t step = 1; step <= 8; step++) {
+		for (uint32_t i = 1; i < 32; i++)
+			m[i] = final_block_word(memLast, (step - 1) * 32 + i - 1);
+		uint32_t next = final_block_word(memLast, step * 32 - 1);
+		blake2b_compress_1w(state, m, step, false, 0);
+		m[0] = next;
 	}
+	for (uint32_t i = 1; i < 32; i++)
+		m[i] = 0;
+	blake2b_compress_1w(state, m, 9, true, 4);
+
+	// same byte order as search2
+	uint64_t hash[4];
+	for (int i = 0; i < 4; i++)
+		for (int j = 0; j < 8; j++)
+			((uchar*)&hash[i])[j] = ((uchar*)&state[i])[7 - j];
+	submit_if_below(hash, target, output, nonce);
+}
+
+// search, search1_local and search2 in one kernel, work groups hash their nonces end to end
+// argon memory never leaves local memory, same work group shape as search1_local
+__kernel void search_fused(
+        __local struct u64_shuffle_buf *shuffle_bufs,
+        __global uint32_t* input,
+        __global uint64_t* output,
+        const ulong startNonce,
+        __global const ulong* target,
+        uint passes, uint lanes, uint segment_blocks,
+        __global const volatile uint* liveEpoch,
+        const uint batchEpoch,
+        __local struct block_g *blocks)
+{
+	__local uint preempted;
+	GROUP_PREEMPTED(preempted);
+	if (preempted)
+		return;
+
+	uint warp = get_local_id(0) / THREADS_PER_LANE;
+	uint job_local = warp / lanes;
+	uint job_id = get_group_id(0) * (get_local_size(0) / (THREADS_PER_LANE * lanes)) + job_local;
+	uint lane = warp % lanes;
+	uint thread = get_local_id(0) % THREADS_PER_LANE;
+	__local struct u64_shuffle_buf *shuffle_buf = &shuffle_bufs[warp];
+	uint lane_blocks = ARGON2_SYNC_POINTS * segment_blocks;
+	blocks += job_local * lanes * lane_blocks;
+	const uint64_t nonce = startNonce + job_id;
+
+	// init: threads 0 and 1 of each lane compute its blocks 0 and 1, as fillFirstBlock
+	if (thread < 2) {
+		uint32_t buffer[32];
+		uint64_t state[8];
+		computeInitialHash(input, buffer, nonce);
+		buffer[0] = 1024;
+		buffer[17] = thread;
+		buffer[18] = lane;
+		initState(state);
+		blake2b_compress_1w(state, buffer, 1, true, 76);
+
+		__local struct block* memCell = (__local struct block*)(blocks + thread * lanes + lane);
+#pragma unroll
+		for (int j = 0; j < 4; j++)
+			memCell->v[j] = state[j];
+		blake2b_compress_loop_local(state, memCell);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	struct block_th prev;
+	fill_local(blocks, shuffle_buf, passes, lanes, segment_blocks, lane, thread, &prev);
+
+	// final: 4 work items of lane 0 hash the xor of the last blocks, as search2
+	// its input & state are staged over the first blocks, not needed anymore
+	__local uint64_t* hashInput = (__local uint64_t*)blocks;
+	__local uint64_t* hashBuffer = hashInput + 129;
+	__local uint32_t* input_32 = (__local uint32_t*)hashInput;
+	__local const uint32_t* last_32 = (__local const uint32_t*)(blocks + (lane_blocks - 1) * lanes);
+	if (lane == 0) {
+		for (uint i = thread; i < ARGON2_BLOCK_SIZE / 4; i += THREADS_PER_LANE) {
+			uint32_t x = last_32[i];
+			for (uint l = 1; l < lanes; l++)
+				x ^= last_32[l * (ARGON2_BLOCK_SIZE / 4) + i];
+			input_32[1 + i] = x;
+		}
+		if (thread == 0)
+			input_32[0] = 32;
 	}
-})_mrb_";
\ No newline at end of file
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	bool hashing = lane == 0 && thread < 4;
+	uint idx = thread & 3;
+	struct partialState state;
+	state.a = blake2b_Init_928[idx];
+	state.b = blake2b_Init_928[idx + 4];
+	for (uint step = 1; step <= 8; step++)
+		blake2b_compress_wg(&state, &hashInput[16 * (step - 1)], hashBuffer, step, idx, hashing, false);
+
+	if (hashing) {
+		zero_buffer(input_32, idx);
+		if (idx == 0)
+			input_32[0] = input_32[256];
+	}
+	blake2b_compress_wg(&state, hashInput, hashBuffer, 9, idx, hashing, true);
+
+	if (hashing) {
+		for (int i = 0; i < 8; i++)
+			((__local uchar*)&hashInput[idx])[i] = ((uchar*)&state.a)[7 - i];
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (hashing && idx == 0) {
+		uint64_t hash[4];
+		for (int i = 0; i < 4; i++)
+			hash[i] = hashInput[i];
+		submit_if_below(hash, target, output, nonce);
+	}
+}
+)_mrb_";
\ No newline at end of file
@@ -1,7 +1,9 @@
 #include "args.h"
 
 #include <assert.h>
+#include <stdlib.h>
 
+#include <algorithm>
 #include <iostream>
 #include <set>
 
@@ -11,6 +13,7 @@
 #include "miner.h"
 #include "miningConfig.h"
 #include "string_utils.h"
+#include "tests.h"
 
 void printUsage() {
     printf("\n%s\n", s_usageMsg.c_str());
@@ -36,7 +39,7 @@ std::pair<bool, uint32_t> parseRefreshRate(const std::string& refreshRateStr) {
     return {false, 0};
 }
 
-bool parseArgs(const char* prefix, int argc, char** argv) {
+bool parseArgs(const char* prefix, int argc, char** argv, int* pExitCode) {
     InputParser ip(argc, argv);
     MiningConfig cfg = miningConfig();
 
@@ -55,6 +58,23 @@ bool parseArgs(const char* prefix, int argc, char** argv) {
         }
     }
 
+    if (ip.cmdOptionExists(OPT_CURL)) {
+        setCurlOnly(true);
+    }
+
+    if (ip.cmdOptionExists(OPT_BENCH_HTTP)) {
+        bool ok = benchmarkHttp();
+        if (pExitCode)
+            *pExitCode = ok ? 0 : 1;
+        return false;
+    }
+    if (ip.cmdOptionExists(OPT_TEST_PROXY)) {
+        bool ok = testProxyServer();
+        if (pExitCode)
+            *pExitCode = ok ? 0 : 1;
+        return false;
+    }
+
     if (ip.cmdOptionExists(OPT_SOLO)) {
         cfg.soloMine = true;
     }
@@ -119,6 +139,75 @@ bool parseArgs(const char* prefix, int argc, char** argv) {
         forceSubmit();
     }
 
+    if (ip.cmdOptionExists(OPT_PIPELINE)) {
+        std::string s = ip.getCmdOption(OPT_PIPELINE);
+        uint32_t depth = 0;
+        if (sscanf(s.c_str(), "%u", &depth) != 1 || depth == 0) {
+            logLine(prefix, "Warning: invalid %s value: %s", OPT_PIPELINE.c_str(), s.c_str());
+        } else {
+            cfg.pipelineDepth = depth;
+        }
+    }
+
+    if (ip.cmdOptionExists(OPT_NO_KERNEL_CACHE)) {
+        cfg.kernelCache = false;
+    }
+
+    if (ip.cmdOptionExists(OPT_AUTOTUNE)) {
+        cfg.autotune = true;
+    }
+
+    if (ip.cmdOptionExists(OPT_CPU_VERIFY)) {
+        std::string s = ip.getCmdOption(OPT_CPU_VERIFY);
+        uint32_t interval = 0;
+        if (sscanf(s.c_str(), "%u", &interval) != 1) {
+            logLine(prefix, "Warning: invalid %s value: %s", OPT_CPU_VERIFY.c_str(), s.c_str());
+        } else {
+            cfg.cpuVerifyInterval = interval;
+        }
+    }
+
+    if (ip.cmdOptionExists(OPT_NO_LONGPOLL)) {
+        cfg.longPoll = false;
+    }
+
+    if (ip.cmdOptionExists(OPT_SPLIT)) {
+        cfg.workWeights.clear();
+        for (const auto& w : split(ip.getCmdOption(OPT_SPLIT), ',')) {
+            cfg.workWeights.push_back((uint32_t)atoi(w.c_str()));
+        }
+        size_t nPools = splitWorkUrls(cfg.getWorkUrl).size();
+        bool validWeights = std::find(cfg.workWeights.begin(), cfg.workWeights.end(), 0u) == cfg.workWeights.end();
+        if (cfg.soloMine || !validWeights || cfg.workWeights.size() != nPools || nPools > MAX_WORK_SOURCES) {
+            logLine(prefix, "Error: %s needs one weight > 0 per -F pool (max %u pools), and cannot be used with %s",
+                    OPT_SPLIT.c_str(), (unsigned)MAX_WORK_SOURCES, OPT_SOLO.c_str());
+            return false;
+        }
+        // a single pool is not split
+        if (nPools == 1) {
+            cfg.workWeights.clear();
+        }
+    }
+
+    if (ip.cmdOptionExists(OPT_PROXY_SERVER)) {
+        int port = atoi(ip.getCmdOption(OPT_PROXY_SERVER).c_str());
+        if (port <= 0 || port > 65535) {
+            logLine(prefix, "Error: invalid %s port", OPT_PROXY_SERVER.c_str());
+            return false;
+        }
+        cfg.proxyServerPort = (uint16_t)port;
+    }
+
+    if (ip.cmdOptionExists(OPT_PROXY_BIND)) {
+        cfg.proxyServerBind = ip.getCmdOption(OPT_PROXY_BIND);
+    }
+
+    // proxy server only serves the work of the primary source
+    if (cfg.proxyServerPort && cfg.workWeights.size()) {
+        logLine(prefix, "Error: %s cannot be used with %s", OPT_PROXY_SERVER.c_str(), OPT_SPLIT.c_str());
+        return false;
+    }
+
     setMiningConfig(cfg);
 
     return true;
@@ -2,7 +2,8 @@
 
 #include <string>
 
-bool parseArgs(const char* prefix, int argc, char** argv);
+// returns false when the miner must not start, *pExitCode is then the process exit code
+bool parseArgs(const char* prefix, int argc, char** argv, int* pExitCode = 0);
 void printUsage();
 std::pair<bool, uint32_t> parseRefreshRate(const std::string& refreshRateStr);
 
@@ -16,15 +17,37 @@ const std::string OPT_SOLO = "--solo";
 const std::string OPT_ARGON = "--argon";
 const std::string OPT_PROXY = "--proxy";
 const std::string OPT_ARGON_SUBMIT = "--submit";
+const std::string OPT_PIPELINE = "--pipeline";
+const std::string OPT_NO_KERNEL_CACHE = "--no-kernel-cache";
+const std::string OPT_AUTOTUNE = "--autotune";
+const std::string OPT_CPU_VERIFY = "--cpu-verify";
+const std::string OPT_NO_LONGPOLL = "--no-longpoll";
+const std::string OPT_SPLIT = "--split";
+const std::string OPT_PROXY_SERVER = "--proxy-server";
+const std::string OPT_PROXY_BIND = "--proxy-bind";
+const std::string OPT_CURL = "--curl";
+const std::string OPT_BENCH_HTTP = "--bench-http";
+const std::string OPT_TEST_PROXY = "--test-proxy";
 
 const std::string s_usageMsg =
     "aquacppminer.exe -F url [-g gpu_id1,gpu_id2,...] [-n nodeUrl] [--solo] [-r refreshRate] [-h]\n"
-    "  -F url         : url of pool or node to mine on, if not specified, will pool mine to dev's aquabase\n"
+    "  -F url         : url of pool or node to mine on, if not specified, will pool mine to dev's aquabase (comma separated list: pools in order of preference, or --solo nodes)\n"
     "  -g id1,id2,... : Commo separate list of gpu ids to use, ex: -g 1,2. By default, uses all gpus available.\n"
     "  -n node_url    : optional node url, to get more stats (pool mining only)\n"
-    "  -r rate        : pool refresh rate, ex: 3s, 2.5m, default is 3s\n"
-    "  --solo         : solo mining, -F needs to be the node url\n"
+    "  -r rate        : pool refresh rate, ex: 3s, 2.5m, default is 3s (polls up to 4x faster right after new work)\n"
+    "  --solo         : solo mining, -F needs to be the node url (ws:// url to get new blocks as soon as the node sees them)\n"
     "  --proxy        : proxy to use, ex: --proxy socks5://127.0.0.1:9150"
     "  --argon x,y,z  : use specific argon params (ex: 4,512,1), skip shares submit if incompatible with HF7\n"
     "  --submit       : when used with --argon, forces submitting shares to pool/node\n"
+    "  --pipeline n   : number of gpu batches in flight per device, default is 2 (1 disables pipelining)\n"
+    "  --no-kernel-cache : always build gpu kernels from source, do not read/write kernel_*.bin cache files\n"
+    "  --autotune     : benchmark batch & work group sizes of each gpu (and fused / 3 kernels pipelines, final hash kernels), best ones are saved to tuning.txt and used by later runs\n"
+    "  --cpu-verify n : re-hash 1 in n gpu results on cpu before submitting them (1 = all), default is 0 (never)\n"
+    "  --no-longpoll  : do not use long polling even if server supports it, always poll for work every few seconds\n"
+    "  --split w1,w2,... : mine all -F pools at the same time, gpu batches are shared between them by weight (ex: -F pool1,pool2 --split 80,20)\n"
+    "  --proxy-server port : also serve getWork / submitWork to other miners on this port, they use -F http://this_host:port (primary pool only, not with --split)\n"
+    "  --proxy-bind ip : address --proxy-server listens on, default is 127.0.0.1 (this host only), ex: the farm LAN ip, or 0.0.0.0 for all interfaces\n"
+    "  --curl         : send all http requests with libcurl (default: built-in keep-alive client for http:// urls without --proxy)\n"
+    "  --bench-http   : measure getWork latency of libcurl & of the keep-alive client on a local stand-in node, then exit\n"
+    "  --test-proxy   : run --proxy-server between a local stand-in pool / node and 8 clients, check work changes & shares reach their destination, then exit, status 1 on failure\n"
     "  -h             : display this help message and exit\n";
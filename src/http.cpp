@@ -3,50 +3,81 @@
 #include <assert.h>
 #include <curl/curl.h>
 
+#include <algorithm>
+#include <cctype>
 #include <cstring>
 #include <string>
 #include <vector>
 
-using std::string;
+#include "keepAliveHttp.h"
 
-// inspired from https://curl.haxx.se/libcurl/c/getinmemory.html
-struct MemoryStruct {
-    char* memory;
-    size_t size;
-};
+using std::string;
 
-static size_t WriteMemoryCallback(void* contents, size_t size, size_t nmemb, void* userp) {
+static size_t WriteStringCallback(void* contents, size_t size, size_t nmemb, void* userp) {
     size_t realsize = size * nmemb;
-    struct MemoryStruct* mem = (struct MemoryStruct*)userp;
+    ((std::string*)userp)->append((const char*)contents, realsize);
+    return realsize;
+}
 
-    mem->memory = (char*)realloc(mem->memory, mem->size + realsize + 1);
-    if (mem->memory == NULL) {
-        printf("FATAL ERROR: httpGetString, not enough memory (realloc returned NULL), aborting now\n");
-        exit(1);
-        return 0;
+static size_t HeaderCallback(char* buffer, size_t size, size_t nitems, void* userp) {
+    size_t realsize = size * nitems;
+    std::vector<std::string>* lines = (std::vector<std::string>*)userp;
+    std::string line(buffer, realsize);
+    while (line.size() && (line.back() == '\r' || line.back() == '\n')) {
+        line.pop_back();
+    }
+    if (line.size()) {
+        lines->push_back(line);
     }
-
-    std::memcpy(&(mem->memory[mem->size]), contents, realsize);
-    mem->size += realsize;
-    mem->memory[mem->size] = 0;
-
     return realsize;
 }
 
-http_connection_handle_t newHttpConnectionHandle() {
-    CURL* curlHandle = curl_easy_init();
-    return (http_connection_handle_t)curlHandle;
+static int ProgressCallback(void* clientp, curl_off_t, curl_off_t, curl_off_t, curl_off_t) {
+    const std::atomic<bool>* pContinue = (const std::atomic<bool>*)clientp;
+    // non zero aborts the transfer
+    return (pContinue && !*pContinue) ? 1 : 0;
 }
 
-void destroyHttpConnectionHandle(http_connection_handle_t h) {
-    CURL* curlHandle = (CURL*)h;
-    if (curlHandle) {
-        curl_easy_cleanup(curlHandle);
+std::string findHttpHeader(const std::vector<std::string>& headerLines, const std::string& name) {
+    auto sameChar = [](char a, char b) { return tolower((unsigned char)a) == tolower((unsigned char)b); };
+    for (const auto& line : headerLines) {
+        if (line.size() > name.size() && line[name.size()] == ':' &&
+            std::equal(name.begin(), name.end(), line.begin(), sameChar)) {
+            size_t start = line.find_first_not_of(' ', name.size() + 1);
+            return (start == string::npos) ? "" : line.substr(start);
+        }
     }
+    return "";
 }
 
+// a handle holds both transports, the url & proxy settings decide which one a request uses
+struct HttpConnection {
+    // created on first libcurl request
+    CURL* curl = nullptr;
+    // request headers set on curl, rebuilt only when they change
+    curl_slist* curlHeaders = nullptr;
+    std::vector<std::string> curlHeaderLines;
+    KeepAliveConnection keepAlive;
+};
+
 static string s_proxy;
 static bool s_proxy_sentinel = false;
+static bool s_curlOnly = false;
+
+http_connection_handle_t newHttpConnectionHandle() {
+    return (http_connection_handle_t) new HttpConnection();
+}
+
+void destroyHttpConnectionHandle(http_connection_handle_t h) {
+    HttpConnection* c = (HttpConnection*)h;
+    if (c) {
+        if (c->curl) {
+            curl_easy_cleanup(c->curl);
+        }
+        curl_slist_free_all(c->curlHeaders);
+        delete c;
+    }
+}
 
 void setGlobalProxy(string s) {
     if (s_proxy_sentinel) {
@@ -56,65 +87,106 @@ void setGlobalProxy(string s) {
     s_proxy = s;
 }
 
+void setCurlOnly(bool curlOnly) {
+    s_curlOnly = curlOnly;
+}
+
+// options that are the same for every request of the handle
+static CURL* curlHandle(HttpConnection* c) {
+    if (!c->curl) {
+        c->curl = curl_easy_init();
+        if (!c->curl) {
+            return nullptr;
+        }
+        // A parameter set to 1 tells libcurl to do a regular HTTP post. This will also make the library use a "Content-Type: application/x-www-form-urlencoded" header.
+        curl_easy_setopt(c->curl, CURLOPT_POST, 1L);
+        if (s_proxy.size()) {
+            curl_easy_setopt(c->curl, CURLOPT_PROXY, s_proxy.c_str());
+        }
+        curl_easy_setopt(c->curl, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+        curl_easy_setopt(c->curl, CURLOPT_WRITEFUNCTION, WriteStringCallback);
+        curl_easy_setopt(c->curl, CURLOPT_XFERINFOFUNCTION, ProgressCallback);
+    }
+    return c->curl;
+}
+
 // inspired from: https://raw.githubusercontent.com/curl/curl/master/docs/examples/postinmemory.c
-// ex: httpPostUrlEncodedRaw("http://www.example.org/", "Field=1&Field=2&Field=3")
 // warning this function will have undefined behavior if same handle is used simultaneously by multiple threads
 // (so user is responsible for thread safety)
-bool httpPost(
-    http_connection_handle_t handle,
+static bool curlPost(
+    HttpConnection* c,
     const std::string& url,
     const std::string& postData,
     std::string& out,
-    const std::vector<std::string>* pHeaderLines) {
-    CURLcode res = CURLE_FAILED_INIT;
-    out.clear();
-
-    if (!handle) {
+    const std::vector<std::string>* pHeaderLines,
+    std::vector<std::string>* pResponseHeaders,
+    long timeoutMs,
+    const std::atomic<bool>* pContinue) {
+    CURL* curl = curlHandle(c);
+    if (!curl) {
         return false;
     }
 
-    struct MemoryStruct chunk;
-    chunk.memory = (char*)malloc(1); /* will be grown as needed by realloc above */
-    chunk.size = 0;                  /* no data at this point */
-
-    CURL* curlHandle = (CURL*)handle;
-    if (curlHandle) {
-        // A parameter set to 1 tells libcurl to do a regular HTTP post. This will also make the library use a "Content-Type: application/x-www-form-urlencoded" header.
-        curl_easy_setopt(curlHandle, CURLOPT_POST, 1L);
-
-        if (pHeaderLines) {
-            struct curl_slist* headers = NULL;
-            for (auto it : *pHeaderLines) {
-                headers = curl_slist_append(headers, it.c_str());
-            }
-            curl_easy_setopt(curlHandle, CURLOPT_HTTPHEADER, headers);
+    static const std::vector<std::string> NO_HEADERS;
+    const std::vector<std::string>& headerLines = pHeaderLines ? *pHeaderLines : NO_HEADERS;
+    if (!c->curlHeaders || headerLines != c->curlHeaderLines) {
+        curl_slist_free_all(c->curlHeaders);
+        c->curlHeaders = nullptr;
+        for (const auto& line : headerLines) {
+            c->curlHeaders = curl_slist_append(c->curlHeaders, line.c_str());
         }
+        c->curlHeaderLines = headerLines;
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, c->curlHeaders);
+    }
 
-        curl_easy_setopt(curlHandle, CURLOPT_POSTFIELDS, postData.c_str());
-        curl_easy_setopt(curlHandle, CURLOPT_POSTFIELDSIZE, postData.size());
-        curl_easy_setopt(curlHandle, CURLOPT_URL, url.c_str());
-
-        s_proxy_sentinel = true;
-        if (s_proxy.size()) {
-            curl_easy_setopt(curlHandle, CURLOPT_PROXY, s_proxy.c_str());
-        }
-        curl_easy_setopt(curlHandle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, postData.c_str());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, postData.size());
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void*)&out);
+
+    // handles are reused, always (re)set per request options
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, pResponseHeaders ? HeaderCallback : NULL);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void*)pResponseHeaders);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeoutMs);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, pContinue ? 0L : 1L);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, (void*)pContinue);
+
+    CURLcode res = curl_easy_perform(curl);
+    if (res != CURLE_OK) {
+        out.clear();
+    }
 
-        curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-        curl_easy_setopt(curlHandle, CURLOPT_WRITEDATA, (void*)&chunk);
+    // todo: show error message on failure via: curl_easy_strerror(res));
+    return (res == CURLE_OK);
+}
 
-        res = curl_easy_perform(curlHandle);
-        if (res == CURLE_OK) {
-            std::vector<char> bytes;
-            bytes.resize(chunk.size, 0);
-            std::memcpy(bytes.data(), chunk.memory, chunk.size);
+// ex: httpPost(handle, "http://www.example.org/", "Field=1&Field=2&Field=3", response)
+// plain http:// urls go through the keep-alive client, libcurl handles proxies & https
+bool httpPost(
+    http_connection_handle_t handle,
+    const std::string& url,
+    const std::string& postData,
+    std::string& out,
+    const std::vector<std::string>* pHeaderLines,
+    std::vector<std::string>* pResponseHeaders,
+    long timeoutMs,
+    const std::atomic<bool>* pContinue) {
+    out.clear();
 
-            out = std::string(bytes.data(), bytes.data() + bytes.size());
-        }
+    HttpConnection* c = (HttpConnection*)handle;
+    if (!c) {
+        if (pResponseHeaders)
+            pResponseHeaders->clear();
+        return false;
     }
 
-    free(chunk.memory);
-
-    // todo: show error message on failure via: curl_easy_strerror(res));
-    return (res == CURLE_OK);
+    s_proxy_sentinel = true;
+    // keep-alive client overwrites header lines in place, libcurl appends them
+    if (!s_curlOnly && s_proxy.empty() && isKeepAliveUrl(url)) {
+        return keepAlivePost(c->keepAlive, url, postData, out, pHeaderLines, pResponseHeaders, timeoutMs, pContinue);
+    }
+    if (pResponseHeaders) {
+        pResponseHeaders->clear();
+    }
+    return curlPost(c, url, postData, out, pHeaderLines, pResponseHeaders, timeoutMs, pContinue);
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <string>
 #include <vector>
 
@@ -10,9 +11,22 @@ void destroyHttpConnectionHandle(http_connection_handle_t h);
 
 void setGlobalProxy(std::string s);
 
+// plain http:// urls use the built-in keep-alive client unless a proxy is set, or curlOnly is true
+// must be called before the first request
+void setCurlOnly(bool curlOnly);
+
+// pResponseHeaders receives the response header lines ("Name: value")
+// timeoutMs is the max duration of the whole request, 0 means no timeout
+// request is aborted as soon as *pContinue becomes false (for long requests)
 bool httpPost(
     http_connection_handle_t handle,
     const std::string& url,
     const std::string& postData,
     std::string& out,
-    const std::vector<std::string>* pHeaderLines = 0);
\ No newline at end of file
+    const std::vector<std::string>* pHeaderLines = 0,
+    std::vector<std::string>* pResponseHeaders = 0,
+    long timeoutMs = 0,
+    const std::atomic<bool>* pContinue = 0);
+
+// value of header "name" (case insensitive) in response header lines, empty if not found
+std::string findHttpHeader(const std::vector<std::string>& headerLines, const std::string& name);
\ No newline at end of file
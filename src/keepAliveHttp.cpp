@@ -0,0 +1,284 @@
+#include "keepAliveHttp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+
+#ifdef _WIN32
+#define strncasecmp _strnicmp
+#endif
+
+const char HTTP_SCHEME[] = "http://";
+const size_t HTTP_SCHEME_LEN = sizeof(HTTP_SCHEME) - 1;
+// getWork / submit requests & responses fit in that, buffers only grow for bigger ones
+const size_t KEEPALIVE_BUFFER_SIZE = 16 * 1024;
+// max delay before an aborted request (pContinue) returns
+const int KEEPALIVE_POLL_MS = 100;
+
+typedef std::chrono::steady_clock::time_point Deadline;
+
+KeepAliveConnection::KeepAliveConnection() : sock(INVALID_SOCKET) {
+    request.reserve(KEEPALIVE_BUFFER_SIZE);
+    response.reserve(KEEPALIVE_BUFFER_SIZE);
+}
+
+KeepAliveConnection::~KeepAliveConnection() {
+    if (sock != INVALID_SOCKET) {
+        closeSocket(sock);
+    }
+}
+
+static void disconnect(KeepAliveConnection& c) {
+    if (c.sock != INVALID_SOCKET) {
+        closeSocket(c.sock);
+        c.sock = INVALID_SOCKET;
+    }
+}
+
+// end of "host:port" in url, which starts after the scheme
+static size_t authorityEnd(const std::string& url) {
+    size_t end = url.find_first_of("/?#", HTTP_SCHEME_LEN);
+    return (end == std::string::npos) ? url.size() : end;
+}
+
+bool isKeepAliveUrl(const std::string& url) {
+    return url.compare(0, HTTP_SCHEME_LEN, HTTP_SCHEME) == 0 && authorityEnd(url) > HTTP_SCHEME_LEN;
+}
+
+// budget of one wait of a request: what is left before its deadline, at most capMs
+static int waitBudgetMs(const Deadline* pDeadline, int capMs) {
+    if (!pDeadline)
+        return capMs;
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(*pDeadline - std::chrono::steady_clock::now()).count();
+    return (int)std::max<long long>(0, std::min<long long>(left, capMs));
+}
+
+static bool connectOrigin(
+    KeepAliveConnection& c,
+    const std::string& url,
+    size_t hostEnd,
+    const Deadline* pDeadline,
+    const std::atomic<bool>* pContinue) {
+    disconnect(c);
+    c.origin.assign(url, HTTP_SCHEME_LEN, hostEnd - HTTP_SCHEME_LEN);
+
+    size_t colon = c.origin.rfind(':');
+    bool hasPort = colon != std::string::npos && c.origin.find(']', colon) == std::string::npos;
+    size_t hostStart = 0;
+    size_t hostLen = hasPort ? colon : c.origin.size();
+    if (hostLen > 2 && c.origin[0] == '[' && c.origin[hostLen - 1] == ']') {
+        hostStart = 1;
+        hostLen -= 2;
+    }
+    c.host.assign(c.origin, hostStart, hostLen);
+    c.port.assign(hasPort ? c.origin.c_str() + colon + 1 : "80");
+
+    c.sock = connectTcp(c.host, c.port, c.error, waitBudgetMs(pDeadline, TCP_CONNECT_TIMEOUT_MS), pContinue);
+    return c.sock != INVALID_SOCKET;
+}
+
+static void buildRequest(
+    KeepAliveConnection& c,
+    const std::string& url,
+    size_t hostEnd,
+    const std::string& postData,
+    const std::vector<std::string>* pHeaderLines) {
+    std::string& r = c.request;
+    r.clear();
+    r.append("POST ");
+    if (hostEnd == url.size() || url[hostEnd] != '/') {
+        r.push_back('/');
+    }
+    r.append(url, hostEnd, std::string::npos);
+    r.append(" HTTP/1.1\r\nHost: ");
+    r.append(c.origin);
+    r.append("\r\nUser-Agent: aquacppminer\r\n");
+    if (pHeaderLines) {
+        for (const auto& line : *pHeaderLines) {
+            r.append(line);
+            r.append("\r\n");
+        }
+    }
+    char contentLength[64];
+    snprintf(contentLength, sizeof(contentLength), "Content-Length: %zu\r\n\r\n", postData.size());
+    r.append(contentLength);
+    r.append(postData);
+}
+
+// appends received bytes to c.response, false on timeout, abort or closed connection
+static bool receiveMore(KeepAliveConnection& c, const Deadline* pDeadline, const std::atomic<bool>* pContinue) {
+    for (;;) {
+        if (pContinue && !*pContinue)
+            return false;
+        int waitMs = KEEPALIVE_POLL_MS;
+        if (pDeadline) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(*pDeadline - std::chrono::steady_clock::now()).count();
+            if (left <= 0)
+                return false;
+            if (left < waitMs)
+                waitMs = (int)left;
+        }
+        if (waitReadable(c.sock, waitMs))
+            return receiveSome(c.sock, c.response);
+    }
+}
+
+// value of header line [start, end) if its name is name (case insensitive), else nullptr
+static const char* headerValue(const char* start, const char* end, const char* name) {
+    size_t n = strlen(name);
+    if ((size_t)(end - start) <= n || start[n] != ':' || strncasecmp(start, name, n) != 0)
+        return nullptr;
+    const char* value = start + n + 1;
+    while (value < end && *value == ' ')
+        value++;
+    return value;
+}
+
+enum ReadResult {
+    READ_OK,
+    // nothing received, server closed a connection it kept open before
+    READ_NOTHING,
+    READ_FAILED
+};
+
+static ReadResult readResponse(
+    KeepAliveConnection& c,
+    std::string& out,
+    std::vector<std::string>* pResponseHeaders,
+    const Deadline* pDeadline,
+    const std::atomic<bool>* pContinue,
+    bool& keepOpen) {
+    c.response.clear();
+    size_t headersEnd;
+    while ((headersEnd = c.response.find("\r\n\r\n")) == std::string::npos) {
+        if (!receiveMore(c, pDeadline, pContinue))
+            return c.response.empty() ? READ_NOTHING : READ_FAILED;
+    }
+
+    // status line, then headers
+    const char* p = c.response.c_str();
+    const char* headersStop = p + headersEnd;
+    keepOpen = strncmp(p, "HTTP/1.1", 8) == 0;
+    long contentLength = -1;
+    bool chunked = false;
+    const char* line = strstr(p, "\r\n") + 2;
+    size_t headerCount = 0;
+    while (line < headersStop) {
+        const char* lineEnd = strstr(line, "\r\n");
+        const char* value;
+        if ((value = headerValue(line, lineEnd, "Content-Length"))) {
+            contentLength = strtol(value, nullptr, 10);
+        } else if ((value = headerValue(line, lineEnd, "Transfer-Encoding"))) {
+            chunked = strncasecmp(value, "chunked", 7) == 0;
+        } else if ((value = headerValue(line, lineEnd, "Connection"))) {
+            keepOpen = strncasecmp(value, "keep-alive", 10) == 0 || (keepOpen && strncasecmp(value, "close", 5) != 0);
+        }
+        if (pResponseHeaders && headerCount < pResponseHeaders->size()) {
+            (*pResponseHeaders)[headerCount].assign(line, lineEnd);
+        } else if (pResponseHeaders) {
+            pResponseHeaders->emplace_back(line, lineEnd);
+        }
+        headerCount++;
+        line = lineEnd + 2;
+    }
+    if (pResponseHeaders) {
+        pResponseHeaders->resize(headerCount);
+    }
+
+    size_t bodyStart = headersEnd + 4;
+    if (chunked) {
+        // chunk: hex size \r\n data \r\n, ends with a 0 size chunk & optional trailers
+        size_t pos = bodyStart;
+        for (;;) {
+            size_t sizeEnd = c.response.find("\r\n", pos);
+            if (sizeEnd != std::string::npos) {
+                size_t chunkSize = strtoul(c.response.c_str() + pos, nullptr, 16);
+                if (chunkSize == 0) {
+                    if (c.response.find("\r\n\r\n", sizeEnd) != std::string::npos)
+                        return READ_OK;
+                } else if (c.response.size() >= sizeEnd + 2 + chunkSize + 2) {
+                    out.append(c.response, sizeEnd + 2, chunkSize);
+                    pos = sizeEnd + 2 + chunkSize + 2;
+                    continue;
+                }
+            }
+            if (!receiveMore(c, pDeadline, pContinue))
+                return READ_FAILED;
+        }
+    }
+    if (contentLength >= 0) {
+        while (c.response.size() < bodyStart + contentLength) {
+            if (!receiveMore(c, pDeadline, pContinue))
+                return READ_FAILED;
+        }
+        out.assign(c.response, bodyStart, contentLength);
+        return READ_OK;
+    }
+
+    // no length: body ends with the connection
+    keepOpen = false;
+    while (receiveMore(c, pDeadline, pContinue)) {
+    }
+    if ((pContinue && !*pContinue) || (pDeadline && std::chrono::steady_clock::now() >= *pDeadline))
+        return READ_FAILED;
+    out.assign(c.response, bodyStart, std::string::npos);
+    return READ_OK;
+}
+
+bool keepAlivePost(
+    KeepAliveConnection& c,
+    const std::string& url,
+    const std::string& postData,
+    std::string& out,
+    const std::vector<std::string>* pHeaderLines,
+    std::vector<std::string>* pResponseHeaders,
+    long timeoutMs,
+    const std::atomic<bool>* pContinue) {
+    Deadline deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    const Deadline* pDeadline = (timeoutMs > 0) ? &deadline : nullptr;
+
+    size_t hostEnd = authorityEnd(url);
+    bool sameOrigin = c.origin.size() == hostEnd - HTTP_SCHEME_LEN &&
+                      url.compare(HTTP_SCHEME_LEN, c.origin.size(), c.origin) == 0;
+    // an idle connection is only readable when the server closed it
+    bool reused = c.sock != INVALID_SOCKET && sameOrigin && !waitReadable(c.sock, 0);
+    if (!reused && !connectOrigin(c, url, hostEnd, pDeadline, pContinue)) {
+        if (pResponseHeaders)
+            pResponseHeaders->clear();
+        return false;
+    }
+
+    buildRequest(c, url, hostEnd, postData, pHeaderLines);
+    for (;;) {
+        out.clear();
+        bool keepOpen = false;
+        bool sent = sendAll(c.sock, c.request.data(), c.request.size(),
+                            waitBudgetMs(pDeadline, TCP_SEND_TIMEOUT_MS), pContinue);
+        ReadResult res = sent ?
+            readResponse(c, out, pResponseHeaders, pDeadline, pContinue, keepOpen) :
+            READ_NOTHING;
+        if (res == READ_OK) {
+            if (!keepOpen)
+                disconnect(c);
+            return true;
+        }
+        disconnect(c);
+
+        // server dropped the kept open connection meanwhile, once per request
+        bool expired = (pContinue && !*pContinue) || (pDeadline && std::chrono::steady_clock::now() >= deadline);
+        if (res == READ_FAILED || !reused || expired) {
+            if (pResponseHeaders)
+                pResponseHeaders->clear();
+            return false;
+        }
+        reused = false;
+        if (!connectOrigin(c, url, hostEnd, pDeadline, pContinue)) {
+            if (pResponseHeaders)
+                pResponseHeaders->clear();
+            return false;
+        }
+    }
+}
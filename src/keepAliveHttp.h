@@ -0,0 +1,46 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "tcpSocket.h"
+
+// small HTTP/1.1 client for plain http:// urls, used by httpPost instead of libcurl when there is no proxy
+// one persistent connection per handle, request & response buffers are reused by all requests:
+// once they have grown to the usual sizes, a request on an open connection does not allocate
+// if the caller also reuses its out string & response header vector
+
+struct KeepAliveConnection {
+    KeepAliveConnection();
+    ~KeepAliveConnection();
+
+    socket_t sock;
+    // "host:port" of the url the socket is connected to
+    std::string origin;
+    // host & port of origin, error of the last connect
+    std::string host;
+    std::string port;
+    std::string error;
+    std::string request;
+    std::string response;
+};
+
+// true for http:// urls with a host
+bool isKeepAliveUrl(const std::string& url);
+
+/**
+ * @brief Same contract as httpPost: true when a whole response was received, whatever its status code.
+ *
+ * A reused connection closed by the server before answering is reopened, and the request sent again.
+ * Response header lines are written over the previous ones, keeping their buffers.
+ */
+bool keepAlivePost(
+    KeepAliveConnection& c,
+    const std::string& url,
+    const std::string& postData,
+    std::string& out,
+    const std::vector<std::string>* pHeaderLines,
+    std::vector<std::string>* pResponseHeaders,
+    long timeoutMs,
+    const std::atomic<bool>* pContinue);
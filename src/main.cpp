@@ -5,8 +5,11 @@
 #include "log.h"
 #include "miner.h"
 #include "miningConfig.h"
+#include "proxyServer.h"
+#include "submitQueue.h"
 #include "tests.h"
 #include "updateThread.h"
+#include "webSocket.h"
 #ifdef _MSC_VER
 #include "windows/procinfo_windows.h"
 #include "windows/win_tools.h"
@@ -137,9 +140,10 @@ int main(int argc, char** argv) {
 #endif
 
     // handle commandline parameters (may change mining config)
-    bool argsOk = parseArgs(COORDINATOR_LOG_PREFIX, argc, argv);
+    int exitCode = 0;
+    bool argsOk = parseArgs(COORDINATOR_LOG_PREFIX, argc, argv, &exitCode);
     if (!argsOk) {
-        return 0;
+        return exitCode;
     }
 
     // Ctrl+C handler
@@ -165,6 +169,10 @@ int main(int argc, char** argv) {
 
     // create & launch update thread
     startUpdateThread();
+    if (miningConfig().proxyServerPort &&
+        !startProxyServer(miningConfig().proxyServerBind, miningConfig().proxyServerPort)) {
+        s_run = false;
+    }
 
     auto tMiningStart = high_resolution_clock::now();
     auto tLast = tMiningStart;
@@ -173,9 +181,15 @@ int main(int argc, char** argv) {
         auto gpuMiners = miningConfig().gpuIds.size();
         logLine(COORDINATOR_LOG_PREFIX, "--- Start %s mining ---",
                 miningConfig().soloMine ? "solo" : "pool");
-        logLine(COORDINATOR_LOG_PREFIX,
-                "%-8s : %s", miningConfig().soloMine ? "node" : "pool",
-                miningConfig().getWorkUrl.c_str());
+        const auto &weights = miningConfig().workWeights;
+        for (size_t i = 0; i < miningConfig().workUrls.size(); i++) {
+            logLine(COORDINATOR_LOG_PREFIX,
+                    "%-8s : %s", miningConfig().soloMine ? "node" : "pool",
+                    miningConfig().workUrls[i].c_str());
+            if (i < weights.size()) {
+                logLine(COORDINATOR_LOG_PREFIX, "weight   : %u", weights[i]);
+            }
+        }
         if (!miningConfig().soloMine &&
             miningConfig().fullNodeUrl.size() > 0) {
             logLine(COORDINATOR_LOG_PREFIX, "node url : %s",
@@ -219,6 +233,16 @@ int main(int argc, char** argv) {
                     nSharesAccepted,
                     nSharesRejected,
                     (nSharesSubmitted == 0) ? 0. : (100. * ((double)nSharesRejected / (double)nSharesSubmitted)));
+
+            // only report submit backpressure, when submits cannot keep up with found shares
+            auto submitStats = submitQueueStats();
+            if (submitStats.peakPending > 1 || submitStats.dropped > 0) {
+                logLine(COORDINATOR_LOG_PREFIX, "submit queue: pending=%u peak=%u dropped=%u avg latency=%.0fms",
+                        submitStats.pending,
+                        submitStats.peakPending,
+                        submitStats.dropped,
+                        submitStats.avgLatencyMs);
+            }
         }
         const uint32_t REPORT_INTERVAL_MS = 5 * 1000;
         std::this_thread::sleep_for(std::chrono::milliseconds(REPORT_INTERVAL_MS));
@@ -231,8 +255,10 @@ int main(int argc, char** argv) {
 
     // kill threads
     logLine(COORDINATOR_LOG_PREFIX, "Stopping Threads");
+    stopProxyServer();
     stopMinerThreads();
     stopUpdateThread();
+    closeWebSockets();
 
     // curl shutdown
     curl_global_cleanup();
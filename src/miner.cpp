@@ -13,7 +13,9 @@
 #include <atomic>
 #include <chrono>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <set>
 #include <sstream>
 #include <thread>
 #include <vector>
@@ -22,8 +24,13 @@
 #include "http.h"
 #include "log.h"
 #include "miningConfig.h"
+#include "programCache.h"
+#include "shareJournal.h"
+#include "submitQueue.h"
 #include "timer.h"
+#include "tuning.h"
 #include "updateThread.h"
+#include "webSocket.h"
 //#include <unistd.h>
 
 #include <CL/cl.h>
@@ -47,6 +54,10 @@ using std::chrono::high_resolution_clock;
 typedef struct __clState {
     cl_context context;
     cl_kernel kernel[3];
+    // search_fused, only built when the argon memory of a nonce fits in local memory
+    cl_kernel fusedKernel;
+    // search2_1w, alternative to kernel[2]
+    cl_kernel final1wKernel;
     size_t n_extra_kernels;
     cl_command_queue commandQueue;
     cl_program program;
@@ -68,6 +79,18 @@ typedef struct __clState {
     size_t max_work_size;
     size_t wsize;
     size_t compute_shaders;
+    // work preemption: kernels compare their batch epoch to liveEpoch and exit if it changed
+    // updated through its own queue, so the update does not wait behind queued batches
+    // best effort only: OpenCL 1.2 does not guarantee that a running kernel sees a write made
+    // from another queue, some drivers only show it to later batches. Correctness does not
+    // depend on it, completeBatch drops results of superseded work by epoch on the host
+    // one live epoch per work source, batches of other sources are not preempted
+    cl_command_queue controlQueue;
+    cl_mem liveEpoch[MAX_WORK_SOURCES];
+    // host copy of liveEpoch, must stay valid during the non blocking write
+    cl_uint hostEpoch[MAX_WORK_SOURCES];
+    // batches of a new work must not start before liveEpoch is updated
+    cl_event epochWritten[MAX_WORK_SOURCES];
 } _clState;
 
 struct MinerInfo {
@@ -93,18 +116,26 @@ static std::atomic<uint32_t> s_nSharesAccepted(0);
 
 // use same atomic for miners and update thread http request ID
 extern std::atomic<uint32_t> s_nodeReqId;
+extern std::string s_configDir;
 
 // TLS storage for miner thread
 thread_local Argon2_Context s_ctx;
 thread_local Bytes s_seed;
-thread_local uint64_t s_nonce = 0;
 thread_local uint8_t s_argonHash[ARGON2_HASH_LEN] = {0};
 thread_local int s_minerThreadID = {-1};
-#pragma message("TODO: what size to use here ?")
-thread_local char s_currentWorkHash[256] = {0};
+// work currently mined by the thread from each source, and next nonce to search on it
+struct ThreadWork {
+    std::shared_ptr<const WorkDescriptor> work;
+    uint64_t epoch = 0;
+    uint64_t nonce = 0;
+    // weighted round robin credit of the source
+    int64_t credit = 0;
+};
+thread_local ThreadWork s_threadWork[MAX_WORK_SOURCES];
 thread_local char s_logPrefix[32] = "MAIN";
 thread_local uint64_t s_threadHashes = 0;
 thread_local uint64_t s_threadShares = 0;
+thread_local uint64_t s_threadResults = 0;
 const size_t PERCENT = 2;
 
 // need to be able to stop main loop from miner threads
@@ -317,17 +348,90 @@ std::string nonceToString(uint64_t nonce) {
     return res;
 }
 
-static std::mutex s_submit_mutex;
-static http_connection_handle_t s_httpHandleSubmit = nullptr;
+// submits are done by a small pool of workers, each with its own persistent connection
+const size_t SUBMIT_WORKERS = 2;
+const std::string SHARE_JOURNAL_FILE_NAME = "shares.journal";
+
+// "result" of a submit response is true when the nonce is accepted
+static bool submitAccepted(const Value &response) {
+    const char *RESULT = "result";
+    if (!response.IsObject() || !response.HasMember(RESULT)) {
+        return false;
+    }
+    if (response[RESULT].IsString()) {
+        return !strcmp(response[RESULT].GetString(), "true");
+    }
+    return response[RESULT].IsBool() && response[RESULT].GetBool();
+}
+
+static std::string submitRequest(uint32_t id, const std::string &nonceStr, const std::string &workHash) {
+    char submitParams[512] = {0};
+    snprintf(
+        submitParams,
+        sizeof(submitParams),
+        "{\"jsonrpc\":\"2.0\", \"id\" : %u, \"method\" : \"aqua_submitWork\", "
+        "\"params\" : [\"%s\",\"%s\",\"0x0000000000000000000000000000000000000000000000000000000000000000\"]}",
+        id,
+        nonceStr.c_str(),
+        workHash.c_str());
+    return submitParams;
+}
 
-void submitThreadFn(uint64_t nonceVal, std::string hashStr, int minerThreadId) {
+// posts a submit request (or a batch of them), posted is false when the request itself failed
+static void postRequest(
+    http_connection_handle_t handle,
+    const std::string &url,
+    const std::string &request,
+    std::string &response,
+    bool &posted) {
     const std::vector<std::string> HTTP_HEADER = {
         "Accept: application/json",
         "Content-Type: application/json"};
 
-    MinerInfo *pMinerInfo = &s_minerThreadsInfo[minerThreadId];
+    // ws:// node: submitted on the socket that receives new heads
+    posted = isWebSocketUrl(url) ?
+        webSocketRpc(url, request, response) :
+        httpPost(handle, url, request, response, &HTTP_HEADER);
+}
+
+// posts a submit request, returns true if the server accepted the nonce
+// posted is false when the request itself failed
+static bool postSubmit(
+    http_connection_handle_t handle,
+    const std::string &url,
+    const std::string &submitParams,
+    std::string &response,
+    bool &posted) {
+    postRequest(handle, url, submitParams, response, posted);
+    if (!posted) {
+        return false;
+    }
+
+    Document doc;
+    doc.Parse(response.c_str());
+    return submitAccepted(doc);
+}
+
+// journaled shares that could not be sent are replayed once the pool answers getWork again
+static void onSubmitFailed(const SubmitJob &job) {
+    const char *logPrefix = s_minerThreadsInfo[job.minerThreadId].logPrefix.c_str();
+    auto nonceStr = nonceToString(job.nonce);
+    if (job.journalId >= 0) {
+        journalOutcome(job.journalId, SHARE_UNSENT);
+        logLine(logPrefix, "submit of nonce %s failed, it will be submitted again once the pool answers", nonceStr.c_str());
+        return;
+    }
+    logLine(
+        logPrefix,
+        "\n\n!!! httpPost failed while trying to submit nonce %s!!!\n",
+        nonceStr.c_str());
+    s_nSharesFound++;
+}
+
+static void submitShare(http_connection_handle_t handle, const SubmitJob &job) {
+    MinerInfo *pMinerInfo = &s_minerThreadsInfo[job.minerThreadId];
 
-    auto nonceStr = nonceToString(nonceVal);
+    auto nonceStr = nonceToString(job.nonce);
 
     // do not submit when testing argon parameters, except if explicitely asked
     if (!submitEnabled()) {
@@ -339,71 +443,164 @@ void submitThreadFn(uint64_t nonceVal, std::string hashStr, int minerThreadId) {
         return;
     }
 
-    char submitParams[512] = {0};
-    snprintf(
-        submitParams,
-        sizeof(submitParams),
-        "{\"jsonrpc\":\"2.0\", \"id\" : %d, \"method\" : \"aqua_submitWork\", "
-        "\"params\" : [\"%s\",\"%s\",\"0x0000000000000000000000000000000000000000000000000000000000000000\"]}",
-        ++s_nodeReqId,
-        nonceStr.c_str(),
-        hashStr.c_str());
+    std::string submitParams = submitRequest(++s_nodeReqId, nonceStr, job.workHash);
+
+    // solo: block is sent to every node at once, so it propagates from all of them
+    // pool: share goes to the pool that gave the work, even after a failover
+    const MiningConfig &cfg = miningConfig();
+    std::vector<std::string> urls = cfg.soloMine ? cfg.workUrls :
+        std::vector<std::string>{job.url.size() ? job.url : cfg.submitWorkUrl};
+    std::vector<std::string> responses(urls.size());
+    std::vector<char> posted(urls.size(), 0);
+    std::vector<char> accepted(urls.size(), 0);
+    auto submitTo = [&](size_t i, http_connection_handle_t h) {
+        bool ok;
+        accepted[i] = postSubmit(h, urls[i], submitParams, responses[i], ok);
+        posted[i] = ok;
+    };
+    std::vector<std::thread> otherNodes;
+    for (size_t i = 1; i < urls.size(); i++) {
+        otherNodes.emplace_back([&, i] {
+            http_connection_handle_t nodeHandle = isWebSocketUrl(urls[i]) ? nullptr : newHttpConnectionHandle();
+            submitTo(i, nodeHandle);
+            if (nodeHandle) {
+                destroyHttpConnectionHandle(nodeHandle);
+            }
+        });
+    }
+    submitTo(0, handle);
+    for (auto &t : otherNodes) {
+        t.join();
+    }
+    size_t nPosted = std::count(posted.begin(), posted.end(), 1);
+    size_t nAccepted = std::count(accepted.begin(), accepted.end(), 1);
 
-    std::string response;
-    bool ok = false;
+    if (nPosted == 0) {
+        onSubmitFailed(job);
+        return;
+    }
+    journalOutcome(job.journalId, SHARE_SUBMITTED);
+    if (nAccepted > 0) {
+        // log
+        char nodes[64] = {0};
+        if (urls.size() > 1) {
+            snprintf(nodes, sizeof(nodes), " (accepted by %zu/%zu nodes)", nAccepted, urls.size());
+        }
+        logLine(
+            pMinerInfo->logPrefix, "%s, nonce = %s%s",
+            miningConfig().soloMine ? "Found block !" : "Found share !",
+            nonceStr.c_str(),
+            nodes);
+        s_nSharesAccepted++;
+    } else {
+        size_t first = std::find(posted.begin(), posted.end(), 1) - posted.begin();
+        logLine(
+            pMinerInfo->logPrefix,
+            "\n\n!!! Rejected %s, nonce = %s!!!\n--server response:--\n%s\n",
+            miningConfig().soloMine ? "block" : "share",
+            nonceStr.c_str(),
+            responses[first].c_str());
+        pMinerInfo->needRegenSeed = true;
+    }
+    s_nSharesFound++;
+}
+
+// pools that answered a json rpc batch with something else than an array
+static std::mutex s_noBatchUrlsMutex;
+static std::set<std::string> s_noBatchUrls;
 
-    // all submits are done through the same CURL HTTPP connection
-    // so protected with a mutex
-    // means that submits will be done sequentially and not in parallel
-    s_submit_mutex.lock();
+// submits shares of the same pool in one json rpc batch, each share gets its own result
+// returns false when the pool does not support batches, shares were not submitted
+static bool submitBatch(http_connection_handle_t handle, const std::string &url, const std::vector<const SubmitJob *> &jobs) {
     {
-        if (!s_httpHandleSubmit) {
-            s_httpHandleSubmit = newHttpConnectionHandle();
+        std::lock_guard<std::mutex> lock(s_noBatchUrlsMutex);
+        if (s_noBatchUrls.count(url)) {
+            return false;
         }
-        ok = httpPost(
-            s_httpHandleSubmit,
-            miningConfig().submitWorkUrl.c_str(),
-            submitParams, response, &HTTP_HEADER);
     }
-    s_submit_mutex.unlock();
 
-    if (!ok) {
-        logLine(
-            pMinerInfo->logPrefix,
-            "\n\n!!! httpPost failed while trying to submit nonce %s!!!\n",
-            nonceStr.c_str());
-    } else {
-        // check that "result" is true
-        const char *RESULT = "result";
-        Document doc;
-        doc.Parse(response.c_str());
-        bool accepted = false;
-        if (doc.IsObject() && doc.HasMember(RESULT)) {
-            if (doc[RESULT].IsString()) {
-                accepted = !strcmp(doc[RESULT].GetString(), "true");
-            } else if (doc[RESULT].IsBool()) {
-                accepted = doc[RESULT].GetBool();
-            }
+    std::vector<uint32_t> ids;
+    std::string request = "[";
+    for (auto pJob : jobs) {
+        ids.push_back(++s_nodeReqId);
+        request += (ids.size() > 1 ? "," : "") + submitRequest(ids.back(), nonceToString(pJob->nonce), pJob->workHash);
+    }
+    request += "]";
+
+    std::string response;
+    bool posted;
+    postRequest(handle, url, request, response, posted);
+    if (!posted) {
+        for (auto pJob : jobs) {
+            onSubmitFailed(*pJob);
         }
+        return true;
+    }
 
-        // log
-        if (accepted) {
-            logLine(
-                pMinerInfo->logPrefix, "%s, nonce = %s",
-                miningConfig().soloMine ? "Found block !" : "Found share !",
-                nonceStr.c_str());
+    Document doc;
+    doc.Parse(response.c_str());
+    if (!doc.IsArray()) {
+        logLine(s_logPrefix, "%s does not support json rpc batches, submitting shares one by one", url.c_str());
+        std::lock_guard<std::mutex> lock(s_noBatchUrlsMutex);
+        s_noBatchUrls.insert(url);
+        return false;
+    }
+
+    // results can come in any order
+    std::map<uint32_t, const Value *> results;
+    for (SizeType i = 0; i < doc.Size(); i++) {
+        if (doc[i].IsObject() && doc[i].HasMember("id") && doc[i]["id"].IsUint()) {
+            results[doc[i]["id"].GetUint()] = &doc[i];
+        }
+    }
+    for (size_t i = 0; i < jobs.size(); i++) {
+        MinerInfo *pMinerInfo = &s_minerThreadsInfo[jobs[i]->minerThreadId];
+        auto nonceStr = nonceToString(jobs[i]->nonce);
+        auto it = results.find(ids[i]);
+        journalOutcome(jobs[i]->journalId, SHARE_SUBMITTED);
+        if (it != results.end() && submitAccepted(*it->second)) {
+            logLine(pMinerInfo->logPrefix, "Found share !, nonce = %s", nonceStr.c_str());
             s_nSharesAccepted++;
         } else {
+            StringBuffer buffer;
+            Writer<StringBuffer> writer(buffer);
+            if (it != results.end()) {
+                it->second->Accept(writer);
+            }
             logLine(
                 pMinerInfo->logPrefix,
-                "\n\n!!! Rejected %s, nonce = %s!!!\n--server response:--\n%s\n",
-                miningConfig().soloMine ? "block" : "share",
+                "\n\n!!! Rejected share, nonce = %s!!!\n--server response:--\n%s\n",
                 nonceStr.c_str(),
-                response.c_str());
+                (it != results.end()) ? buffer.GetString() : response.c_str());
             pMinerInfo->needRegenSeed = true;
         }
+        s_nSharesFound++;
+    }
+    return true;
+}
+
+// submit worker handler: shares found close together go to their pool in one request
+static void submitShares(http_connection_handle_t handle, const std::vector<SubmitJob> &jobs) {
+    const MiningConfig &cfg = miningConfig();
+    if (jobs.size() == 1 || cfg.soloMine || !submitEnabled()) {
+        for (const auto &job : jobs) {
+            submitShare(handle, job);
+        }
+        return;
+    }
+
+    std::map<std::string, std::vector<const SubmitJob *>> poolJobs;
+    for (const auto &job : jobs) {
+        poolJobs[job.url.size() ? job.url : cfg.submitWorkUrl].push_back(&job);
+    }
+    for (const auto &it : poolJobs) {
+        if (it.second.size() > 1 && submitBatch(handle, it.first, it.second)) {
+            continue;
+        }
+        for (auto pJob : it.second) {
+            submitShare(handle, *pJob);
+        }
     }
-    s_nSharesFound++;
 }
 
 static std::mutex s_rand_mutex;
@@ -415,7 +612,70 @@ int r() {
     return r;
 }
 
-bool hash(const WorkParams &p, mpz_t mpz_result, uint64_t nonce, Argon2_Context &ctx) {
+// queues the nonce for submit workers, never blocks the miner thread
+static void submitNonce(const WorkDescriptor &work, uint64_t nonce) {
+    SubmitJob job;
+    job.nonce = nonce;
+    job.workHash = work.hash;
+    job.url = work.url;
+    job.minerThreadId = s_minerThreadID;
+    // journaled before submit, so it survives a failed submit or a crash
+    job.journalId = submitEnabled() ? journalShare(nonce, work.epoch, work.hash, work.url, s_minerThreadID) : -1;
+    int64_t journalId = job.journalId;
+
+    // solo blocks go first, a late block is worthless
+    bool solo = miningConfig().soloMine;
+    if (!pushSubmitJob(std::move(job), solo)) {
+        if (journalId >= 0) {
+            journalOutcome(journalId, SHARE_UNSENT);
+            logLine(s_logPrefix, "Warning: submit queue full, nonce %s will be submitted later", nonceToString(nonce).c_str());
+        } else {
+            logLine(s_logPrefix, "Warning: submit queue full, nonce %s dropped", nonceToString(nonce).c_str());
+        }
+        return;
+    }
+    if (!solo) {
+        s_threadShares++;
+    }
+}
+
+void replayUnsentShares() {
+    if (!hasUnsentShares()) {
+        return;
+    }
+    bool solo = miningConfig().soloMine;
+    for (const auto &share : takeUnsentShares()) {
+        // only shares of current work can still be accepted
+        bool current = false;
+        for (size_t source = 0; source < workSourceCount() && !current; source++) {
+            auto work = currentWork(source);
+            current = work && work->hash == share.workHash;
+        }
+        int minerThreadId = (share.minerThreadId >= 0 && share.minerThreadId < (int)s_minerThreadsInfo.size()) ? share.minerThreadId : 0;
+        const char *logPrefix = s_minerThreadsInfo[minerThreadId].logPrefix.c_str();
+        auto nonceStr = nonceToString(share.nonce);
+        if (!current) {
+            journalOutcome(share.id, SHARE_STALE);
+            logLine(logPrefix, "unsent nonce %s dropped, its work is stale", nonceStr.c_str());
+            continue;
+        }
+
+        SubmitJob job;
+        job.nonce = share.nonce;
+        job.workHash = share.workHash;
+        job.url = share.url;
+        job.minerThreadId = minerThreadId;
+        job.journalId = share.id;
+        if (!pushSubmitJob(std::move(job), solo)) {
+            journalOutcome(share.id, SHARE_UNSENT);
+            continue;
+        }
+        logLine(logPrefix, "submitting unsent nonce %s again", nonceStr.c_str());
+    }
+}
+
+// re-computes the hash of nonce on cpu (s_seed must hold the work header), to audit gpu results
+static bool cpuHashMatches(uint64_t nonce, const uint8_t *gpuHash, Argon2_Context &ctx) {
     // update the seed with the new nonce
     updateAquaSeed(nonce, s_seed);
 
@@ -426,30 +686,7 @@ bool hash(const WorkParams &p, mpz_t mpz_result, uint64_t nonce, Argon2_Context
         assert(0);
         return false;
     }
-
-    // convert hash to a mpz (big int)
-    // printf("[cpu] outhash = %llx %llx %llx %llx\n", ((uint64_t*)&ctx.out[0])[0], ((uint64_t*)&ctx.out[0])[1], ((uint64_t*)&ctx.out[0])[2], ((uint64_t*)&ctx.out[0])[3]);
-    mpz_fromBytesNoInit(ctx.out, ctx.outlen, mpz_result);
-
-    //
-    bool needSubmit = mpz_cmp(mpz_result, p.mpz_target) < 0;
-
-    // compare to target
-    if (needSubmit) {
-        if (miningConfig().soloMine) {
-            // for solo mining we do a synchronous submit ASAP
-            submitThreadFn(s_nonce, p.hash, s_minerThreadID);
-        } else {
-            // for pool mining we launch a thread to submit work asynchronously
-            // like that we can continue mining while curl performs the request & wait for a response
-            std::thread{submitThreadFn, s_nonce, p.hash, s_minerThreadID}.detach();
-            s_threadShares++;
-
-            // sleep for a short duration, to allow the submit thread launch its request asap
-            std::this_thread::sleep_for(std::chrono::milliseconds(1));
-        }
-    }
-    return true;
+    return memcmp(ctx.out, gpuHash, ctx.outlen) == 0;
 }
 
 uint64_t makeAquaNonce() {
@@ -585,6 +822,775 @@ void check_clEnqueueReadBuffer(cl_command_queue queue, cl_mem buffer, cl_bool bl
 
 size_t source_len;
 
+// max winning nonces a batch can report, search2 counts the extra ones so overflow is detected
+static const uint32_t RESULT_SLOTS = 15;
+
+// one winning nonce & its argon2 hash, as written by search2
+struct BatchResult {
+    cl_ulong nonce;
+    // hash as a 256 bits big endian number, most significant word first
+    cl_ulong hash[4];
+};
+
+// batch output buffer: winners count followed by the winners
+struct BatchResults {
+    cl_ulong count;
+    BatchResult entries[RESULT_SLOTS];
+};
+
+// one batch of nonces in flight on the device
+// each batch owns its memory / result buffers, so several batches can be queued at the same time
+struct BatchSlot {
+    cl_mem buffer1 = nullptr;
+    cl_mem CLbuffer0 = nullptr;
+    cl_mem outputBuffer = nullptr;
+    cl_mem targetBuffer = nullptr;
+    // signaled when the result of the batch has been copied back to host
+    cl_event readDone = nullptr;
+    bool inFlight = false;
+    // host copies, must stay valid until the non-blocking transfers are done
+    unsigned char header[32];
+    BatchResults results;
+    // target is uploaded only when it changes
+    cl_ulong target[4];
+    bool targetUploaded = false;
+    uint64_t startNonce = 0;
+    // work of the batch, kept alive until its results are handled
+    std::shared_ptr<const WorkDescriptor> work;
+};
+
+// global argon memory layout of the kernels (NONCE_MEM): with 1, qwords of INTERLEAVE_NONCES consecutive
+// nonces are interleaved, for coalesced accesses in search & search2 (cmake -DINTERLEAVED_MEMORY=ON)
+#ifndef INTERLEAVED_MEMORY
+#define INTERLEAVED_MEMORY (0)
+#endif
+const uint32_t INTERLEAVE_NONCES = 32;
+
+// shape of the batches sent to the device, derived from argon params & device limits
+struct BatchConfig {
+    // nonces per batch
+    size_t throughput;
+    // argon2 memory layout, must match the ALGO_* macros the kernel is built with
+    uint32_t passes;
+    uint32_t lanes;
+    uint32_t segmentBlocks;
+    size_t memPerNonce;
+    // work group sizes, see TuningParams
+    uint32_t searchLocal;
+    uint32_t fillJobsPerGroup;
+    uint32_t finalJobsPerGroup;
+    // search1_local: argon memory of each nonce stays in local memory during the fill
+    bool fillOnChip;
+    // search_fused instead of the 3 kernels, work groups shaped as search1_local (fillJobsPerGroup)
+    bool fused;
+    // search2_1w instead of search2, one work item per nonce (finalJobsPerGroup is its local size)
+    bool finalPerNonce;
+
+    // throughput must be a multiple of every kernel's nonces per work group (all powers of 2)
+    // and of the interleaved nonces
+    size_t nonceGranularity() const {
+        return std::max<size_t>({searchLocal, fillJobsPerGroup, finalJobsPerGroup,
+                                 INTERLEAVED_MEMORY ? INTERLEAVE_NONCES : 1u});
+    }
+};
+
+static BatchConfig argonBatchConfig() {
+    const uint32_t ARGON_BLOCK_BYTES = 1024;
+    const uint32_t SYNC_POINTS = 4;
+
+    BatchConfig cfg;
+    cfg.throughput = 8192 * 4;
+    cfg.passes = AQUA_ARGON_TIME;
+    cfg.lanes = AQUA_ARGON_LANES;
+    // same rounding as argon2: at least 2 blocks per segment, multiple of 4 * lanes
+    uint32_t memoryBlocks = std::max<uint32_t>(AQUA_ARGON_MEM, 2 * SYNC_POINTS * cfg.lanes);
+    cfg.segmentBlocks = memoryBlocks / (SYNC_POINTS * cfg.lanes);
+    cfg.memPerNonce = (size_t)cfg.segmentBlocks * SYNC_POINTS * cfg.lanes * ARGON_BLOCK_BYTES;
+    cfg.searchLocal = 64;
+    cfg.fillJobsPerGroup = 1;
+    cfg.finalJobsPerGroup = 8;
+    cfg.fillOnChip = false;
+    cfg.fused = false;
+    cfg.finalPerNonce = false;
+    return cfg;
+}
+
+// u64_shuffle of search1 uses hardware sub group shuffles instead of local memory + barriers
+static bool hasSubGroupShuffle(cl_device_id dev_id) {
+    std::string extensions = " " + deviceInfoString(dev_id, CL_DEVICE_EXTENSIONS) + " ";
+    return extensions.find(" cl_intel_subgroups ") != std::string::npos ||
+           (extensions.find(" cl_khr_subgroups ") != std::string::npos &&
+            extensions.find(" cl_khr_subgroup_shuffle ") != std::string::npos);
+}
+
+static std::string kernelBuildOptions(cl_device_id dev_id) {
+    char options[256];
+    snprintf(options, sizeof(options), "-DALGO_PASSES=%d -DALGO_MCOST=%d -DALGO_LANES=%d -DRESULT_SLOTS=%u%s",
+             AQUA_ARGON_TIME, AQUA_ARGON_MEM, AQUA_ARGON_LANES, RESULT_SLOTS,
+             hasSubGroupShuffle(dev_id) ? " -DSUBGROUP_SHUFFLE" : "");
+    std::string res = options;
+    if (INTERLEAVED_MEMORY) {
+        res += " -DINTERLEAVED_MEMORY -DINTERLEAVE_NONCES=" + std::to_string(INTERLEAVE_NONCES);
+    }
+    return res;
+}
+
+// search2 local memory: 129 qwords of input + 18 qwords of blake2b state per nonce
+static size_t finalLocalMemSize(uint32_t jobsPerGroup) {
+    return (129 + 18) * sizeof(cl_ulong) * jobsPerGroup;
+}
+
+// search1 local memory: one u64 shuffle buffer per warp
+static size_t fillLocalMemSize(uint32_t lanes, uint32_t jobsPerGroup) {
+    return lanes * jobsPerGroup * 32 * sizeof(cl_uint) * 2;
+}
+
+// search1_local also holds the whole argon memory of its nonces
+static size_t fillOnChipMemSize(const BatchConfig &cfg, uint32_t jobsPerGroup) {
+    return fillLocalMemSize(cfg.lanes, jobsPerGroup) + cfg.memPerNonce * jobsPerGroup;
+}
+
+// on-chip fill as soon as one nonce fits in local memory (HF7: 8 KiB),
+// nonces per group are then limited to what fits
+static void chooseFillKernel(cl_device_id dev_id, BatchConfig &cfg) {
+    cl_ulong localMem = 0;
+    clGetDeviceInfo(dev_id, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(localMem), &localMem, NULL);
+    cfg.fillOnChip = fillOnChipMemSize(cfg, 1) <= localMem;
+    if (cfg.fillOnChip) {
+        while (cfg.fillJobsPerGroup > 1 && fillOnChipMemSize(cfg, cfg.fillJobsPerGroup) > localMem)
+            cfg.fillJobsPerGroup /= 2;
+    }
+}
+
+// reduces batch size until one batch of argon memory fits on the device, for each batch in flight
+static void fitBatchToDevice(cl_device_id dev_id, BatchConfig &cfg, size_t batchesInFlight) {
+    const size_t NONCE_GRANULARITY = cfg.nonceGranularity();
+    // search_fused keeps argon memory on chip
+    if (cfg.fused) {
+        return;
+    }
+
+    cl_ulong maxAlloc = 0, globalMem = 0;
+    clGetDeviceInfo(dev_id, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(maxAlloc), &maxAlloc, NULL);
+    clGetDeviceInfo(dev_id, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(globalMem), &globalMem, NULL);
+    cl_ulong maxBytes = std::min<cl_ulong>(maxAlloc, globalMem / std::max<size_t>(batchesInFlight, 1));
+    if (maxBytes == 0) {
+        return;
+    }
+
+    size_t maxNonces = (size_t)(maxBytes / cfg.memPerNonce);
+    maxNonces -= maxNonces % NONCE_GRANULARITY;
+    if (maxNonces < NONCE_GRANULARITY) {
+        logLine(s_logPrefix, "Error: argon params need %u KiB per nonce, too much for this device",
+                (unsigned)(cfg.memPerNonce / 1024));
+        exit(1);
+    }
+    cfg.throughput = std::min(cfg.throughput, maxNonces);
+    cfg.throughput -= cfg.throughput % NONCE_GRANULARITY;
+}
+
+static void initPreemption(__clState &cll, cl_device_id dev_id) {
+    cl_int status;
+    cll.controlQueue = clCreateCommandQueue(cll.context, dev_id, 0, &status);
+    if (status != CL_SUCCESS || !cll.controlQueue) {
+        printf("clCreateCommandQueue (%d)\n", status);
+        exit(1);
+    }
+    for (size_t source = 0; source < workSourceCount(); source++) {
+        cll.liveEpoch[source] = clCreateBuffer(cll.context, CL_MEM_READ_ONLY, sizeof(cl_uint), NULL, &status);
+        if (status != CL_SUCCESS) {
+            printf("clCreateBuffer (%d)\n", status);
+            exit(1);
+        }
+        cll.hostEpoch[source] = 0;
+        cll.epochWritten[source] = nullptr;
+        status = clEnqueueWriteBuffer(cll.controlQueue, cll.liveEpoch[source], CL_TRUE, 0, sizeof(cl_uint), &cll.hostEpoch[source], 0, NULL, NULL);
+        if (status != CL_SUCCESS) {
+            printf("EnqueueWriteBuffer failed %d", status);
+            exit(1);
+        }
+    }
+}
+
+// makes batches of older works of source still queued on the device exit early
+static void preemptOlderWork(__clState &cll, size_t source, uint64_t epoch) {
+    if ((cl_uint)epoch == cll.hostEpoch[source]) {
+        return;
+    }
+    // previous write is done: it was waited on by the batches enqueued since, or by this one
+    cl_event &written = cll.epochWritten[source];
+    if (written) {
+        clWaitForEvents(1, &written);
+        clReleaseEvent(written);
+    }
+    cll.hostEpoch[source] = (cl_uint)epoch;
+    cl_int status = clEnqueueWriteBuffer(cll.controlQueue, cll.liveEpoch[source], CL_FALSE, 0, sizeof(cl_uint), &cll.hostEpoch[source], 0, NULL, &written);
+    if (status != CL_SUCCESS) {
+        printf("EnqueueWriteBuffer failed %d", status);
+        exit(1);
+    }
+    clFlush(cll.controlQueue);
+}
+
+static void releasePreemption(__clState &cll) {
+    clFinish(cll.controlQueue);
+    for (size_t source = 0; source < workSourceCount(); source++) {
+        if (cll.epochWritten[source])
+            clReleaseEvent(cll.epochWritten[source]);
+        clReleaseMemObject(cll.liveEpoch[source]);
+    }
+    clReleaseCommandQueue(cll.controlQueue);
+}
+
+static void checkEnqueue(cl_int status, const char *what, cl_program program, cl_device_id dev_id) {
+    if (status != CL_SUCCESS) {
+        printf("%s (%d). Build log follows:\n", what, status);
+        get_program_build_log(program, dev_id);
+        fflush(stdout);
+        exit(1);
+    }
+}
+
+// search, search1 (or search1_local) & search2, chained with events
+static void enqueueKernels(__clState &cll, cl_device_id dev_id, BatchSlot &slot, const BatchConfig &cfg,
+                           cl_mem liveEpoch, cl_uint batchEpoch, cl_uint nUploads, const cl_event *uploadDone,
+                           cl_event *kernelDone) {
+    const size_t throughput = cfg.throughput;
+    cl_int status;
+
+    // init - search
+    clSetKernelArg(cll.kernel[0], 0, sizeof(cl_mem), (void *)&slot.buffer1);
+    clSetKernelArg(cll.kernel[0], 1, sizeof(cl_mem), (void *)&slot.CLbuffer0);
+    clSetKernelArg(cll.kernel[0], 2, sizeof(uint64_t), &slot.startNonce);
+    clSetKernelArg(cll.kernel[0], 3, sizeof(cl_mem), (void *)&liveEpoch);
+    clSetKernelArg(cll.kernel[0], 4, sizeof(cl_uint), &batchEpoch);
+
+    // fill - search 1, one 32 threads warp per lane, each warp has its own shuffle buffer
+    size_t bufferSize = fillLocalMemSize(cfg.lanes, cfg.fillJobsPerGroup);
+    size_t blocksSize = cfg.memPerNonce * cfg.fillJobsPerGroup;
+
+    clSetKernelArg(cll.kernel[1], 0, bufferSize, NULL);
+    clSetKernelArg(cll.kernel[1], 1, sizeof(slot.buffer1), (void *)&slot.buffer1);
+    clSetKernelArg(cll.kernel[1], 2, sizeof(uint32_t), &cfg.passes);
+    clSetKernelArg(cll.kernel[1], 3, sizeof(uint32_t), &cfg.lanes);
+    clSetKernelArg(cll.kernel[1], 4, sizeof(uint32_t), &cfg.segmentBlocks);
+    clSetKernelArg(cll.kernel[1], 5, sizeof(cl_mem), (void *)&liveEpoch);
+    clSetKernelArg(cll.kernel[1], 6, sizeof(cl_uint), &batchEpoch);
+    if (cfg.fillOnChip)
+        clSetKernelArg(cll.kernel[1], 7, blocksSize, NULL);
+
+    // final - search 2 (4 work items per nonce) or search2_1w (1 work item per nonce)
+    if (cfg.finalPerNonce) {
+        clSetKernelArg(cll.final1wKernel, 0, sizeof(slot.buffer1), (void *)&slot.buffer1);
+        clSetKernelArg(cll.final1wKernel, 1, sizeof(slot.outputBuffer), (void *)&slot.outputBuffer);
+        clSetKernelArg(cll.final1wKernel, 2, sizeof(uint64_t), &slot.startNonce);
+        clSetKernelArg(cll.final1wKernel, 3, sizeof(slot.targetBuffer), (void *)&slot.targetBuffer);
+        clSetKernelArg(cll.final1wKernel, 4, sizeof(cl_mem), (void *)&liveEpoch);
+        clSetKernelArg(cll.final1wKernel, 5, sizeof(cl_uint), &batchEpoch);
+    } else {
+        size_t smem = finalLocalMemSize(cfg.finalJobsPerGroup);
+        clSetKernelArg(cll.kernel[2], 0, sizeof(slot.buffer1), (void *)&slot.buffer1);
+        clSetKernelArg(cll.kernel[2], 1, sizeof(slot.outputBuffer), (void *)&slot.outputBuffer);
+        clSetKernelArg(cll.kernel[2], 2, smem, NULL);
+        clSetKernelArg(cll.kernel[2], 3, sizeof(uint64_t), &slot.startNonce);
+        clSetKernelArg(cll.kernel[2], 4, sizeof(slot.targetBuffer), (void *)&slot.targetBuffer);
+        clSetKernelArg(cll.kernel[2], 5, sizeof(cl_mem), (void *)&liveEpoch);
+        clSetKernelArg(cll.kernel[2], 6, sizeof(cl_uint), &batchEpoch);
+    }
+
+    const size_t global[1] = {throughput};
+    const size_t local[1] = {cfg.searchLocal};
+    status = clEnqueueNDRangeKernel(cll.commandQueue, cll.kernel[0], 1, NULL, global, local, nUploads, uploadDone, &kernelDone[0]);
+    checkEnqueue(status, "lEnqueueNDRangeKernel[0]", cll.program, dev_id);
+
+    const size_t global2[1] = {throughput * 32 * cfg.lanes};
+    const size_t local2[1] = {32 * cfg.lanes * cfg.fillJobsPerGroup};
+    status = clEnqueueNDRangeKernel(cll.commandQueue, cll.kernel[1], 1, NULL, global2, local2, 1, &kernelDone[0], &kernelDone[1]);
+    checkEnqueue(status, "lEnqueueNDRangeKernel[1]", cll.program, dev_id);
+
+    if (cfg.finalPerNonce) {
+        const size_t global3[1] = {throughput};
+        const size_t local3[1] = {cfg.finalJobsPerGroup};
+        status = clEnqueueNDRangeKernel(cll.commandQueue, cll.final1wKernel, 1, NULL, global3, local3, 1, &kernelDone[1], &kernelDone[2]);
+    } else {
+        const size_t global3[2] = {4, throughput};
+        const size_t local3[2] = {4, cfg.finalJobsPerGroup};
+        status = clEnqueueNDRangeKernel(cll.commandQueue, cll.kernel[2], 2, NULL, global3, local3, 1, &kernelDone[1], &kernelDone[2]);
+    }
+    checkEnqueue(status, "lEnqueueNDRangeKernel[2]", cll.program, dev_id);
+}
+
+// search_fused, its event stands for the 3 kernels
+static void enqueueFusedKernel(__clState &cll, cl_device_id dev_id, BatchSlot &slot, const BatchConfig &cfg,
+                               cl_mem liveEpoch, cl_uint batchEpoch, cl_uint nUploads, const cl_event *uploadDone,
+                               cl_event *kernelDone) {
+    size_t bufferSize = fillLocalMemSize(cfg.lanes, cfg.fillJobsPerGroup);
+    size_t blocksSize = cfg.memPerNonce * cfg.fillJobsPerGroup;
+    clSetKernelArg(cll.fusedKernel, 0, bufferSize, NULL);
+    clSetKernelArg(cll.fusedKernel, 1, sizeof(cl_mem), (void *)&slot.CLbuffer0);
+    clSetKernelArg(cll.fusedKernel, 2, sizeof(slot.outputBuffer), (void *)&slot.outputBuffer);
+    clSetKernelArg(cll.fusedKernel, 3, sizeof(uint64_t), &slot.startNonce);
+    clSetKernelArg(cll.fusedKernel, 4, sizeof(slot.targetBuffer), (void *)&slot.targetBuffer);
+    clSetKernelArg(cll.fusedKernel, 5, sizeof(uint32_t), &cfg.passes);
+    clSetKernelArg(cll.fusedKernel, 6, sizeof(uint32_t), &cfg.lanes);
+    clSetKernelArg(cll.fusedKernel, 7, sizeof(uint32_t), &cfg.segmentBlocks);
+    clSetKernelArg(cll.fusedKernel, 8, sizeof(cl_mem), (void *)&liveEpoch);
+    clSetKernelArg(cll.fusedKernel, 9, sizeof(cl_uint), &batchEpoch);
+    clSetKernelArg(cll.fusedKernel, 10, blocksSize, NULL);
+
+    const size_t global[1] = {cfg.throughput * 32 * cfg.lanes};
+    const size_t local[1] = {32 * cfg.lanes * cfg.fillJobsPerGroup};
+    cl_int status = clEnqueueNDRangeKernel(cll.commandQueue, cll.fusedKernel, 1, NULL, global, local, nUploads, uploadDone, &kernelDone[2]);
+    checkEnqueue(status, "lEnqueueNDRangeKernel[fused]", cll.program, dev_id);
+    kernelDone[0] = kernelDone[1] = kernelDone[2];
+    clRetainEvent(kernelDone[2]);
+    clRetainEvent(kernelDone[2]);
+}
+
+// queues the whole batch (upload, search, search1, search2 or search_fused, download) without blocking
+// commands are chained with events, only slot.readDone has to be waited on by host
+// if kernelEvents is not null, it receives the events of the 3 kernels (to be released by caller)
+static void enqueueBatch(__clState &cll, cl_device_id dev_id, BatchSlot &slot, const BatchConfig &cfg,
+                         cl_event *kernelEvents = nullptr) {
+    cl_int status;
+    cl_event uploadDone[4], kernelDone[3];
+    cl_uint nUploads = 2;
+    cl_uint batchEpoch = (cl_uint)slot.work->epoch;
+    cl_mem liveEpoch = cll.liveEpoch[slot.work->source];
+    cl_event epochWritten = cll.epochWritten[slot.work->source];
+
+    status = clEnqueueWriteBuffer(cll.commandQueue, slot.CLbuffer0, CL_FALSE, 0, sizeof(slot.header), slot.header, 0, NULL, &uploadDone[0]);
+    if (status != CL_SUCCESS) {
+        printf("EnqueueWriteBuffer failed %d", status);
+        exit(1);
+    }
+    // only the winners count needs a reset
+    static const cl_ulong ZERO = 0;
+    status = clEnqueueWriteBuffer(cll.commandQueue, slot.outputBuffer, CL_FALSE, 0, sizeof(ZERO), &ZERO, 0, NULL, &uploadDone[1]);
+    if (status != CL_SUCCESS) {
+        printf("EnqueueWriteBuffer failed %d", status);
+        exit(1);
+    }
+
+    const uint64_t *target = slot.work->deviceTarget;
+    if (!slot.targetUploaded || memcmp(target, slot.target, sizeof(slot.target))) {
+        memcpy(slot.target, target, sizeof(slot.target));
+        status = clEnqueueWriteBuffer(cll.commandQueue, slot.targetBuffer, CL_FALSE, 0, sizeof(slot.target), slot.target, 0, NULL, &uploadDone[nUploads++]);
+        if (status != CL_SUCCESS) {
+            printf("EnqueueWriteBuffer failed %d", status);
+            exit(1);
+        }
+        slot.targetUploaded = true;
+    }
+
+    // batch must see the live epoch of its own work
+    if (epochWritten) {
+        clRetainEvent(epochWritten);
+        uploadDone[nUploads++] = epochWritten;
+    }
+
+    if (cfg.fused)
+        enqueueFusedKernel(cll, dev_id, slot, cfg, liveEpoch, batchEpoch, nUploads, uploadDone, kernelDone);
+    else
+        enqueueKernels(cll, dev_id, slot, cfg, liveEpoch, batchEpoch, nUploads, uploadDone, kernelDone);
+
+    check_clEnqueueReadBuffer(cll.commandQueue, slot.outputBuffer,
+                              CL_FALSE,          // cl_bool blocking_read
+                              0,                     // size_t offset
+                              sizeof(slot.results),  // size_t size
+                              &slot.results,         // void *ptr
+                              1,                 // cl_uint num_events_in_wait_list
+                              &kernelDone[2],    // cl_event *event_wait_list
+                              &slot.readDone);
+
+    // runtime keeps events alive while commands still depend on them
+    for (cl_uint i = 0; i < nUploads; i++)
+        clReleaseEvent(uploadDone[i]);
+    for (int i = 0; i < 3; i++) {
+        if (kernelEvents)
+            kernelEvents[i] = kernelDone[i];
+        else
+            clReleaseEvent(kernelDone[i]);
+    }
+
+    // make sure the batch is submitted to the device now, host will not block on it before next batch
+    clFlush(cll.commandQueue);
+    slot.inFlight = true;
+}
+
+// blocks until the batch is done, then checks / submits its result
+static void completeBatch(BatchSlot &slot, size_t throughput) {
+    clWaitForEvents(1, &slot.readDone);
+    clReleaseEvent(slot.readDone);
+    slot.readDone = nullptr;
+    slot.inFlight = false;
+
+    // batch of a superseded work: it was preempted on device, or ran to the end (finished just
+    // before, or the driver did not show it the new liveEpoch), its results are stale and its hashes do not count
+    if (slot.work->epoch != currentWorkEpoch(slot.work->source)) {
+        uint32_t stale = std::min((uint32_t)slot.results.count, RESULT_SLOTS);
+        if (stale > 0) {
+            logLine(s_logPrefix, "%u result(s) of previous work dropped", stale);
+        }
+        return;
+    }
+
+    // count is a 32 bits counter on device
+    uint32_t found = (uint32_t)slot.results.count;
+    if (found > RESULT_SLOTS) {
+        logLine(s_logPrefix, "Warning: %u winning nonces in batch, only %u reported", found, RESULT_SLOTS);
+        found = RESULT_SLOTS;
+    }
+    if (found > 0) {
+        // verify with the batch own header
+        memcpy(s_seed.data(), slot.header, sizeof(slot.header));
+        const uint32_t verifyInterval = miningConfig().cpuVerifyInterval;
+        for (uint32_t i = 0; i < found; i++) {
+            const BatchResult &res = slot.results.entries[i];
+            uint8_t resHash[ARGON2_HASH_LEN];
+            for (uint32_t j = 0; j < ARGON2_HASH_LEN; j++)
+                resHash[j] = (uint8_t)(res.hash[j / 8] >> (56 - 8 * (j % 8)));
+
+            // sampled cpu audit of gpu hashes, drops the result on mismatch
+            if (verifyInterval && (++s_threadResults % verifyInterval) == 0) {
+                if (!cpuHashMatches(res.nonce, resHash, s_ctx)) {
+                    logLine(s_logPrefix, "Error: gpu hash of nonce %s does not match cpu hash, result dropped",
+                            nonceToString(res.nonce).c_str());
+                    continue;
+                }
+            }
+
+            // both big endian, byte compare is a number compare
+            if (memcmp(resHash, slot.work->target, sizeof(resHash)) < 0) {
+                submitNonce(*slot.work, res.nonce);
+            }
+        }
+    }
+    s_threadHashes += throughput;
+    s_totalHashes += throughput;
+}
+
+// picks the work source of the next batch, -1 if no source has work yet
+// smooth weighted round robin: with weights 80/20, 1 batch in 5 goes to the second source, evenly spaced
+static int pickWorkSource() {
+    const size_t nSources = workSourceCount();
+    if (nSources == 1) {
+        return currentWorkEpoch(0) ? 0 : -1;
+    }
+    const auto &weights = miningConfig().workWeights;
+    int best = -1;
+    int64_t totalWeight = 0;
+    for (size_t i = 0; i < nSources; i++) {
+        // a source without work does not get batches, nor credit
+        if (currentWorkEpoch(i) == 0) {
+            continue;
+        }
+        s_threadWork[i].credit += weights[i];
+        totalWeight += weights[i];
+        if (best < 0 || s_threadWork[i].credit > s_threadWork[best].credit) {
+            best = (int)i;
+        }
+    }
+    if (best >= 0) {
+        s_threadWork[best].credit -= totalWeight;
+    }
+    return best;
+}
+
+// picks the work & nonce range of the next batch, returns false if there is no work yet
+static bool prepareBatch(BatchSlot &slot, int minerID, bool solo, size_t throughput) {
+    // only the epochs are read each batch, a work itself only when it changed
+    int source = pickWorkSource();
+    if (source < 0) {
+        // no work yet, sleep until an update thread gets some, from any pool (timeout only to check for exit)
+        waitAnyWork(std::chrono::milliseconds(500));
+        return false;
+    }
+    ThreadWork &tw = s_threadWork[source];
+
+    // check if work has changed
+    if (currentWorkEpoch(source) != tw.epoch) {
+        tw.work = currentWork(source);
+        tw.epoch = tw.work->epoch;
+
+        // generate the TLS nonce again
+        tw.nonce = makeAquaNonce();
+#if DEBUG_NONCES
+        logLine(s_logPrefix, "new work starting nonce: %s", nonceToString(tw.nonce).c_str());
+#endif
+    } else if (s_minerThreadsInfo[minerID].needRegenSeed) {
+        // pool has rejected the nonce, record current number of succesfull pool getWork requests
+        uint32_t getWorkCountOfRejectedShare = getPoolGetWorkCount();
+
+        // generate a new nonce
+        tw.nonce = makeAquaNonce();
+
+        s_minerThreadsInfo[minerID].needRegenSeed = false;
+#if DEBUG_NONCES
+        logLine(s_logPrefix, "regen nonce after reject: %s", nonceToString(tw.nonce).c_str());
+#endif
+        // wait for update thread to get new work
+        if (!solo) {
+#define WAIT_NEW_WORK_AFTER_REJECT (1)
+#if (WAIT_NEW_WORK_AFTER_REJECT == 0)
+            logLine(s_logPrefix, "regenerated nonce after a reject, not waiting for pool to send new work !");
+#else
+            logLine(s_logPrefix, "Thread stopped mining because last share rejected, waiting for new work from pool");
+            // woken by update thread as soon as next getWork succeeds
+            while (s_bMinerThreadsRun &&
+                   waitPoolGetWork(getWorkCountOfRejectedShare, std::chrono::milliseconds(500)) == getWorkCountOfRejectedShare) {
+            }
+            logLine(s_logPrefix, "Thread resumes mining");
+#endif
+        }
+    }
+
+    slot.work = tw.work;
+    slot.startNonce = tw.nonce;
+    memcpy(slot.header, tw.work->header, sizeof(slot.header));
+
+    // next batch of this source continues after this one
+    tw.nonce += throughput;
+    return true;
+}
+
+static double eventSeconds(cl_event start, cl_event end) {
+    cl_ulong t0 = 0, t1 = 0;
+    clGetEventProfilingInfo(start, CL_PROFILING_COMMAND_START, sizeof(t0), &t0, NULL);
+    clGetEventProfilingInfo(end, CL_PROFILING_COMMAND_END, sizeof(t1), &t1, NULL);
+    return (t1 > t0) ? (t1 - t0) * 1e-9 : 0.0;
+}
+
+// device time of each kernel & of the whole batch, best of a few runs
+struct BatchTimings {
+    double kernel[3];
+    double total;
+};
+
+static BatchTimings timeBatch(__clState &cll, cl_device_id dev_id, BatchSlot &slot, const BatchConfig &cfg) {
+    const int RUNS = 3;
+    BatchTimings best = {{1e9, 1e9, 1e9}, 1e9};
+    // first run is a warmup
+    for (int run = 0; run <= RUNS; run++) {
+        cl_event kernelDone[3];
+        enqueueBatch(cll, dev_id, slot, cfg, kernelDone);
+        clWaitForEvents(1, &slot.readDone);
+        clReleaseEvent(slot.readDone);
+        slot.readDone = nullptr;
+        slot.inFlight = false;
+        if (run > 0) {
+            for (int i = 0; i < 3; i++)
+                best.kernel[i] = std::min(best.kernel[i], eventSeconds(kernelDone[i], kernelDone[i]));
+            best.total = std::min(best.total, eventSeconds(kernelDone[0], kernelDone[2]));
+        }
+        for (auto evt : kernelDone)
+            clReleaseEvent(evt);
+    }
+    return best;
+}
+
+// picks the work group size with the lowest device time for one kernel
+// candidates are nonces per work group, setter applies one to the config
+template <typename Setter>
+static void tuneKernelLocal(__clState &cll, cl_device_id dev_id, BatchSlot &slot, BatchConfig &cfg,
+                            int kernelIdx, const char *name, const std::vector<uint32_t> &candidates, Setter set) {
+    uint32_t bestValue = 0;
+    double bestTime = 0;
+    for (auto value : candidates) {
+        if (cfg.throughput % value)
+            continue;
+        set(cfg, value);
+        double t = timeBatch(cll, dev_id, slot, cfg).kernel[kernelIdx];
+        logLine(s_logPrefix, "autotune: %s %3u -> %.2f ms", name, value, t * 1e3);
+        if (bestValue == 0 || t < bestTime) {
+            bestValue = value;
+            bestTime = t;
+        }
+    }
+    if (bestValue)
+        set(cfg, bestValue);
+}
+
+// a tuning entry edited by hand, or saved by another driver / build, may not fit this device:
+// sizes must be powers of 2, throughput a multiple of all of them, and local sizes within kernel limits
+static bool validTuning(__clState &cll, cl_device_id dev_id, BatchConfig cfg, const TuningParams &tuning) {
+    auto isPowerOf2 = [](uint32_t n) { return n && !(n & (n - 1)); };
+    if (!tuning.throughput || !isPowerOf2(tuning.searchLocal) || !isPowerOf2(tuning.fillJobsPerGroup) ||
+        !isPowerOf2(tuning.finalJobsPerGroup))
+        return false;
+    cfg.searchLocal = tuning.searchLocal;
+    cfg.fillJobsPerGroup = tuning.fillJobsPerGroup;
+    cfg.finalJobsPerGroup = tuning.finalJobsPerGroup;
+    if (tuning.throughput % cfg.nonceGranularity())
+        return false;
+
+    auto fits = [&](cl_kernel kernel, size_t localSize) {
+        size_t kernelMax = 0;
+        clGetKernelWorkGroupInfo(kernel, dev_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(kernelMax), &kernelMax, NULL);
+        return localSize <= kernelMax;
+    };
+    size_t fillLocal = 32 * cfg.lanes * cfg.fillJobsPerGroup;
+    if (tuning.fused && cll.fusedKernel)
+        return fits(cll.fusedKernel, fillLocal);
+    bool finalFits = (tuning.finalPerNonce && cll.final1wKernel) ? fits(cll.final1wKernel, cfg.finalJobsPerGroup)
+                                                                 : fits(cll.kernel[2], 4 * cfg.finalJobsPerGroup);
+    return fits(cll.kernel[0], cfg.searchLocal) && fits(cll.kernel[1], fillLocal) && finalFits;
+}
+
+// sweeps work group sizes of each kernel, then batch size, measuring with event profiling
+static TuningParams autotuneBatchConfig(__clState &cll, cl_device_id dev_id, BatchConfig cfg) {
+    // batches within this ratio of best hashrate are considered equal, the smallest one is kept
+    // (shorter batches react faster to new work)
+    const double THROUGHPUT_TOLERANCE = 0.98;
+    const size_t MAX_TUNE_THROUGHPUT = 8192 * 16;
+    const int THROUGHPUT_STEPS = 4;
+
+    logLine(s_logPrefix, "autotune: started, this can take a few minutes");
+
+    cl_ulong localMem = 0;
+    clGetDeviceInfo(dev_id, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(localMem), &localMem, NULL);
+    size_t kernelMax[3] = {0, 0, 0};
+    for (int i = 0; i < 3; i++) {
+        clGetKernelWorkGroupInfo(cll.kernel[i], dev_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(kernelMax[i]), &kernelMax[i], NULL);
+    }
+
+    std::vector<uint32_t> searchCandidates, fillCandidates, finalCandidates;
+    for (uint32_t n = 16; n <= 256; n *= 2) {
+        if (n <= kernelMax[0])
+            searchCandidates.push_back(n);
+    }
+    for (uint32_t n = 1; n <= 8; n *= 2) {
+        size_t fillMem = cfg.fillOnChip ? fillOnChipMemSize(cfg, n) : fillLocalMemSize(cfg.lanes, n);
+        if (32 * cfg.lanes * n <= kernelMax[1] && fillMem <= localMem)
+            fillCandidates.push_back(n);
+    }
+    for (uint32_t n = 1; n <= 32; n *= 2) {
+        if (4 * n <= kernelMax[2] && finalLocalMemSize(n) <= localMem)
+            finalCandidates.push_back(n);
+    }
+    if (searchCandidates.empty() || fillCandidates.empty() || finalCandidates.empty()) {
+        logLine(s_logPrefix, "autotune: device limits too small, keeping default config");
+        return {(uint32_t)cfg.throughput, cfg.searchLocal, cfg.fillJobsPerGroup, cfg.finalJobsPerGroup, 0, 0};
+    }
+    // search2_1w has one work item per nonce, no local memory
+    std::vector<uint32_t> final1wCandidates;
+    size_t final1wMax = 0;
+    clGetKernelWorkGroupInfo(cll.final1wKernel, dev_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(final1wMax), &final1wMax, NULL);
+    for (uint32_t n = 16; n <= 256; n *= 2) {
+        if (n <= final1wMax)
+            final1wCandidates.push_back(n);
+    }
+    // search_fused has the shape of search1_local, with more registers
+    std::vector<uint32_t> fusedCandidates;
+    if (cll.fusedKernel) {
+        size_t fusedMax = 0;
+        clGetKernelWorkGroupInfo(cll.fusedKernel, dev_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(fusedMax), &fusedMax, NULL);
+        for (auto n : fillCandidates) {
+            if (32 * cfg.lanes * n <= fusedMax)
+                fusedCandidates.push_back(n);
+        }
+    }
+
+    // largest batch that fits, all batch candidates reuse its buffers
+    cfg.searchLocal = searchCandidates.back();
+    cfg.fillJobsPerGroup = fillCandidates.back();
+    cfg.finalJobsPerGroup = finalCandidates.back();
+    cfg.throughput = MAX_TUNE_THROUGHPUT;
+    fitBatchToDevice(dev_id, cfg, miningConfig().pipelineDepth);
+    const size_t maxThroughput = cfg.throughput;
+
+    // tune on dummy work, with a target no hash can reach
+    BatchSlot slot;
+    cl_int status;
+    slot.buffer1 = clCreateBuffer(cll.context, CL_MEM_READ_WRITE, maxThroughput * cfg.memPerNonce, NULL, &status);
+    slot.CLbuffer0 = clCreateBuffer(cll.context, CL_MEM_READ_WRITE, 128, NULL, &status);
+    slot.outputBuffer = clCreateBuffer(cll.context, CL_MEM_WRITE_ONLY, sizeof(BatchResults), NULL, &status);
+    slot.targetBuffer = clCreateBuffer(cll.context, CL_MEM_READ_ONLY, sizeof(slot.target), NULL, &status);
+    if (!slot.buffer1 || !slot.CLbuffer0 || !slot.outputBuffer || !slot.targetBuffer) {
+        printf("clCreateBuffer (%d)\n", status);
+        exit(1);
+    }
+    auto tuneWork = std::make_shared<WorkDescriptor>();
+    tuneWork->target[31] = 1;
+    tuneWork->deviceTarget[3] = 1;
+    slot.work = tuneWork;
+    memset(slot.header, 0, sizeof(slot.header));
+
+    // kernel timings need a profiling queue
+    cl_command_queue miningQueue = cll.commandQueue;
+    cll.commandQueue = clCreateCommandQueue(cll.context, dev_id, CL_QUEUE_PROFILING_ENABLE, &status);
+    if (status != CL_SUCCESS || !cll.commandQueue) {
+        printf("clCreateCommandQueue (%d)\n", status);
+        exit(1);
+    }
+
+    // kernels are independent, tune their work group sizes one by one at max batch size
+    tuneKernelLocal(cll, dev_id, slot, cfg, 0, "search  local size    ", searchCandidates,
+                    [](BatchConfig &c, uint32_t v) { c.searchLocal = v; });
+    tuneKernelLocal(cll, dev_id, slot, cfg, 1, "search1 nonces / group", fillCandidates,
+                    [](BatchConfig &c, uint32_t v) { c.fillJobsPerGroup = v; });
+    tuneKernelLocal(cll, dev_id, slot, cfg, 2, "search2 nonces / group", finalCandidates,
+                    [](BatchConfig &c, uint32_t v) { c.finalJobsPerGroup = v; });
+
+    // search2_1w against the tuned search2
+    if (final1wCandidates.size()) {
+        BatchConfig final1wCfg = cfg;
+        final1wCfg.finalPerNonce = true;
+        tuneKernelLocal(cll, dev_id, slot, final1wCfg, 2, "search2_1w local size ", final1wCandidates,
+                        [](BatchConfig &c, uint32_t v) { c.finalJobsPerGroup = v; });
+        double finalTime = timeBatch(cll, dev_id, slot, cfg).kernel[2];
+        double final1wTime = timeBatch(cll, dev_id, slot, final1wCfg).kernel[2];
+        logLine(s_logPrefix, "autotune: search2 %.2f ms, search2_1w %.2f ms", finalTime * 1e3, final1wTime * 1e3);
+        if (final1wTime < finalTime)
+            cfg = final1wCfg;
+    }
+
+    // then the fused kernel against the 3 tuned ones
+    if (fusedCandidates.size()) {
+        BatchConfig fusedCfg = cfg;
+        fusedCfg.fused = true;
+        tuneKernelLocal(cll, dev_id, slot, fusedCfg, 2, "fused   nonces / group", fusedCandidates,
+                        [](BatchConfig &c, uint32_t v) { c.fillJobsPerGroup = v; });
+        double kernelsTime = timeBatch(cll, dev_id, slot, cfg).total;
+        double fusedTime = timeBatch(cll, dev_id, slot, fusedCfg).total;
+        logLine(s_logPrefix, "autotune: 3 kernels %.2f ms, fused kernel %.2f ms", kernelsTime * 1e3, fusedTime * 1e3);
+        if (fusedTime < kernelsTime)
+            cfg = fusedCfg;
+    }
+
+    // then batch size, from largest to smallest
+    std::vector<std::pair<size_t, double>> rates;
+    size_t granularity = cfg.nonceGranularity();
+    for (int step = 0; step < THROUGHPUT_STEPS; step++) {
+        size_t throughput = maxThroughput >> step;
+        throughput -= throughput % granularity;
+        if (throughput < granularity)
+            break;
+        cfg.throughput = throughput;
+        double t = timeBatch(cll, dev_id, slot, cfg).total;
+        double rate = (t > 0) ? throughput / t : 0;
+        logLine(s_logPrefix, "autotune: batch %6u nonces -> %.1f H/s", (unsigned)throughput, rate);
+        rates.push_back({throughput, rate});
+    }
+    double bestRate = 0;
+    for (const auto &r : rates)
+        bestRate = std::max(bestRate, r.second);
+    for (const auto &r : rates) {
+        if (r.second >= bestRate * THROUGHPUT_TOLERANCE)
+            cfg.throughput = r.first;
+    }
+
+    clReleaseCommandQueue(cll.commandQueue);
+    cll.commandQueue = miningQueue;
+    clReleaseMemObject(slot.buffer1);
+    clReleaseMemObject(slot.CLbuffer0);
+    clReleaseMemObject(slot.outputBuffer);
+    clReleaseMemObject(slot.targetBuffer);
+
+    return {(uint32_t)cfg.throughput, cfg.searchLocal, cfg.fillJobsPerGroup, cfg.finalJobsPerGroup, cfg.fused ? 1u : 0u,
+            cfg.finalPerNonce ? 1u : 0u};
+}
+
 void minerThreadFn(int minerID) {
     // Use one of available devices from configuration
     cl_device_id dev_id = *(miningConfig().gpuIds.at(minerID));
@@ -597,7 +1603,11 @@ void minerThreadFn(int minerID) {
         printf("clCreateContext (%d)\n", status);
 
     /* Creating command queue associate with the context.*/
-    cll.commandQueue = clCreateCommandQueue(cll.context, dev_id, 0, &status);
+    // batches only depend on each other through events, let the device reorder them if it can
+    cl_command_queue_properties queueProps = 0;
+    clGetDeviceInfo(dev_id, CL_DEVICE_QUEUE_PROPERTIES, sizeof(queueProps), &queueProps, NULL);
+    queueProps &= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+    cll.commandQueue = clCreateCommandQueue(cll.context, dev_id, queueProps, &status);
     if (status != CL_SUCCESS || !cll.commandQueue)
         printf("clCreateCommandQueue (%d)\n", status);
 
@@ -610,208 +1620,175 @@ void minerThreadFn(int minerID) {
     source_len = strlen(ocl_code);
 #endif
 
-    /* Create and build program. */
-    cll.program = clCreateProgramWithSource(cll.context, 1, (const char **)&source,
-                                            &source_len, &status);
-    if (status != CL_SUCCESS || !cll.program)
-        printf("clCreateProgramWithSource (%d)\n", status);
-    status = clBuildProgram(cll.program, 1, &dev_id,
-                            "",  // compile options
-                            NULL, NULL);
-    if (status != CL_SUCCESS) {
-        printf("OpenCL build failed (%d). Build log follows:\n", status);
-        get_program_build_log(cll.program, dev_id);
-        fflush(stdout);
+    // generate log prefix
+    snprintf(s_logPrefix, sizeof(s_logPrefix), "MINER_%02d", minerID);
+    s_minerThreadsInfo[minerID].logPrefix.assign(s_logPrefix);
+
+    /* Create and build program (or load it from kernel cache). */
+    // kernel is specialized for the active argon params
+    if (hasSubGroupShuffle(dev_id)) {
+        logLine(s_logPrefix, "device has sub group shuffles, used by the argon fill");
+    }
+    cll.program = buildProgramCached(s_logPrefix, cll.context, dev_id, source, source_len,
+                                     kernelBuildOptions(dev_id));  // compile options
+    if (!cll.program) {
         exit(1);
     }
 
+    // each nonce needs its own argon memory
+    BatchConfig batchCfg = argonBatchConfig();
+    chooseFillKernel(dev_id, batchCfg);
+
     // Create kernel objects ToDo Iterate over kernel arrays
     cll.kernel[0] = clCreateKernel(cll.program, "search", &status);
     if (status != CL_SUCCESS || !cll.kernel[0])
         printf("clCreateKernel-0 (%d)\n", status);
-    cll.kernel[1] = clCreateKernel(cll.program, "search1", &status);
+    cll.kernel[1] = clCreateKernel(cll.program, batchCfg.fillOnChip ? "search1_local" : "search1", &status);
     if (status != CL_SUCCESS || !cll.kernel[1])
         printf("clCreateKernel-1 (%d)\n", status);
     cll.kernel[2] = clCreateKernel(cll.program, "search2", &status);
     if (status != CL_SUCCESS || !cll.kernel[2])
         printf("clCreateKernel-2 (%d)\n", status);
+    cll.final1wKernel = clCreateKernel(cll.program, "search2_1w", &status);
+    if (status != CL_SUCCESS || !cll.final1wKernel)
+        printf("clCreateKernel-2_1w (%d)\n", status);
+    cll.fusedKernel = nullptr;
+    if (batchCfg.fillOnChip) {
+        cll.fusedKernel = clCreateKernel(cll.program, "search_fused", &status);
+        if (status != CL_SUCCESS || !cll.fusedKernel)
+            printf("clCreateKernel-fused (%d)\n", status);
+    }
 
-#define AR2D_MEM_PER_BATCH 8192
-    size_t throughput = 8192 * 4;
-    size_t mem_size = throughput * AR2D_MEM_PER_BATCH;
+    initPreemption(cll, dev_id);
+
+    // best sizes depend on the device and on the kernel specialization
+    std::string tuningKey = deviceIdentity(dev_id) + " " + kernelBuildOptions(dev_id);
+    TuningParams tuning;
+    bool tuned = false;
+    if (miningConfig().autotune) {
+        tuning = autotuneBatchConfig(cll, dev_id, batchCfg);
+        saveTuning(tuningKey, tuning);
+        tuned = true;
+    } else {
+        tuned = loadTuning(tuningKey, tuning);
+        if (tuned && !validTuning(cll, dev_id, batchCfg, tuning)) {
+            logLine(s_logPrefix, "ignoring tuning entry %u %u %u %u, it does not fit this device, using defaults (--autotune to redo it)",
+                    tuning.throughput, tuning.searchLocal, tuning.fillJobsPerGroup, tuning.finalJobsPerGroup);
+            tuned = false;
+        }
+    }
+    if (tuned) {
+        batchCfg.throughput = tuning.throughput;
+        batchCfg.searchLocal = tuning.searchLocal;
+        batchCfg.fillJobsPerGroup = tuning.fillJobsPerGroup;
+        batchCfg.finalJobsPerGroup = tuning.finalJobsPerGroup;
+        // tuning of an older build may not fit the on-chip fill
+        chooseFillKernel(dev_id, batchCfg);
+        batchCfg.fused = tuning.fused && cll.fusedKernel;
+        batchCfg.finalPerNonce = tuning.finalPerNonce && cll.final1wKernel;
+        if (batchCfg.fused) {
+            logLine(s_logPrefix, "using tuned config: fused kernel, local size %u",
+                    32 * batchCfg.lanes * batchCfg.fillJobsPerGroup);
+        } else {
+            logLine(s_logPrefix, "using tuned config: local sizes %u / %u / %u%s",
+                    batchCfg.searchLocal, 32 * batchCfg.lanes * batchCfg.fillJobsPerGroup,
+                    (batchCfg.finalPerNonce ? 1 : 4) * batchCfg.finalJobsPerGroup,
+                    batchCfg.finalPerNonce ? " (search2_1w)" : "");
+        }
+    }
+    fitBatchToDevice(dev_id, batchCfg, miningConfig().pipelineDepth);
+    // search_fused does not use the global argon memory, a placeholder buffer is enough
+    size_t mem_size = batchCfg.fused ? batchCfg.memPerNonce : batchCfg.throughput * batchCfg.memPerNonce;
     size_t readbufsize = 128;
-    cll.buffer1 = clCreateBuffer(cll.context, CL_MEM_READ_WRITE, mem_size, NULL, &status);
-    cll.CLbuffer0 = clCreateBuffer(cll.context, CL_MEM_READ_WRITE, readbufsize, NULL, &status);
-    cll.outputBuffer = clCreateBuffer(cll.context, CL_MEM_WRITE_ONLY, 100, NULL, &status);
-    uint64_t *pnonces;
-    pnonces = (uint64_t *)malloc(sizeof(uint64_t) * 1);
+
+    // all lanes of a nonce are filled by the same work group
+    size_t maxWorkGroupSize = 0;
+    clGetDeviceInfo(dev_id, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(maxWorkGroupSize), &maxWorkGroupSize, NULL);
+    if (32 * batchCfg.lanes * batchCfg.fillJobsPerGroup > maxWorkGroupSize) {
+        logLine(s_logPrefix, "Error: %u lanes need work groups of %u threads, device max is %u",
+                batchCfg.lanes, 32 * batchCfg.lanes * batchCfg.fillJobsPerGroup, (unsigned)maxWorkGroupSize);
+        exit(1);
+    }
+    logLine(s_logPrefix, "batch size: %u nonces, %u MiB of argon memory",
+            (unsigned)batchCfg.throughput, (unsigned)(mem_size >> 20));
+    if (batchCfg.fused) {
+        logLine(s_logPrefix, "fused kernel, argon memory in local memory only, %u KiB per work group",
+                (unsigned)(fillOnChipMemSize(batchCfg, batchCfg.fillJobsPerGroup) >> 10));
+    } else if (batchCfg.fillOnChip) {
+        logLine(s_logPrefix, "argon fill in local memory, %u KiB per work group",
+                (unsigned)(fillOnChipMemSize(batchCfg, batchCfg.fillJobsPerGroup) >> 10));
+    }
 
     // record thread id in TLS
     s_minerThreadID = minerID;
 
-    // generate log prefix
-    snprintf(s_logPrefix, sizeof(s_logPrefix), "MINER_%02d", minerID);
-    s_minerThreadsInfo[minerID].logPrefix.assign(s_logPrefix);
+    // one set of buffers per batch in flight, use less batches if device runs out of memory
+    std::vector<BatchSlot> slots(miningConfig().pipelineDepth);
+    for (size_t i = 0; i < slots.size(); i++) {
+        BatchSlot &slot = slots[i];
+        slot.buffer1 = clCreateBuffer(cll.context, CL_MEM_READ_WRITE, mem_size, NULL, &status);
+        if (status == CL_SUCCESS) {
+            slot.CLbuffer0 = clCreateBuffer(cll.context, CL_MEM_READ_WRITE, readbufsize, NULL, &status);
+        }
+        if (status == CL_SUCCESS) {
+            slot.outputBuffer = clCreateBuffer(cll.context, CL_MEM_WRITE_ONLY, sizeof(BatchResults), NULL, &status);
+        }
+        if (status == CL_SUCCESS) {
+            slot.targetBuffer = clCreateBuffer(cll.context, CL_MEM_READ_ONLY, sizeof(slot.target), NULL, &status);
+        }
+        if (status != CL_SUCCESS) {
+            if (i == 0) {
+                printf("clCreateBuffer (%d)\n", status);
+                exit(1);
+            }
+            logLine(s_logPrefix, "Warning: not enough device memory for %u batches in flight, using %u",
+                    (unsigned)slots.size(), (unsigned)i);
+            for (auto mem : {slot.buffer1, slot.CLbuffer0, slot.outputBuffer, slot.targetBuffer}) {
+                if (mem)
+                    clReleaseMemObject(mem);
+            }
+            slots.resize(i);
+            break;
+        }
+    }
 
     // init thread TLS variables that need it
     s_seed.resize(40, 0);
     setupAquaArgonCtx(s_ctx, s_seed, s_argonHash);
 
-    // init mpz that will hold result
-    // initialization is pretty costly, so should stay here, done only one time
-    // (actual value of mpzResult is set by mpz_fromBytesNoInit inside hash() func)
-    mpz_t mpz_result;
-    mpz_init(mpz_result);
-
     bool solo = miningConfig().soloMine;
 
+    // slots are used round robin, oldest batch is always the next one
+    // host only waits on the oldest batch, the others keep the device busy meanwhile
+    size_t oldest = 0;
     while (s_bMinerThreadsRun) {
-        // get params for current block
-        WorkParams prms = currentWorkParams();
-        // if params valid
-        if (prms.hash.size() != 0) {
-            // check if work hash has changed
-            if (strcmp(prms.hash.c_str(), s_currentWorkHash)) {
-                // generate the TLS nonce & seed nonce again
-                s_nonce = makeAquaNonce();
-
-                generateAquaSeed(s_nonce, prms.hash, s_seed);
-                // save current hash in TLS
-                strcpy(s_currentWorkHash, prms.hash.c_str());
-#if DEBUG_NONCES
-                logLine(s_logPrefix, "new work starting nonce: %s", nonceToString(s_nonce).c_str());
-#endif
-            } else {
-                if (s_minerThreadsInfo[minerID].needRegenSeed) {
-                    // pool has rejected the nonce, record current number of succesfull pool getWork requests
-                    uint32_t getWorkCountOfRejectedShare = getPoolGetWorkCount();
-
-                    // generate a new nonce
-                    s_nonce = makeAquaNonce();
-
-                    s_minerThreadsInfo[minerID].needRegenSeed = false;
-#if DEBUG_NONCES
-                    logLine(s_logPrefix, "regen nonce after reject: %s", nonceToString(s_nonce).c_str());
-#endif
-                    // wait for update thread to get new work
-                    if (!solo) {
-#define WAIT_NEW_WORK_AFTER_REJECT (1)
-#if (WAIT_NEW_WORK_AFTER_REJECT == 0)
-                        logLine(s_logPrefix, "regenerated nonce after a reject, not waiting for pool to send new work !");
-#else
-                        logLine(s_logPrefix, "Thread stopped mining because last share rejected, waiting for new work from pool");
-                        while (1) {
-                            if (getPoolGetWorkCount() != getWorkCountOfRejectedShare) {
-                                break;
-                            }
-                            std::this_thread::sleep_for(std::chrono::seconds(5));
-                        }
-                        logLine(s_logPrefix, "Thread resumes mining");
-#endif
-                    }
-                } else {
-                    // only inc the TLS nonce
-                    s_nonce++;
-                }
-            }
-
-            // hash
-            cl_int status = 0;
-            unsigned int num = 0;
-
-            cl_ulong le_target;
-            void *some = mpz_export(nullptr, 0, 1, 8, 0, 0, prms.mpz_target);
-            le_target = ((uint64_t *)some)[0];
-            for (int i = 0; i < 32; i++)
-                cll.cldata[i] = s_seed[i];
-
-            status = clEnqueueWriteBuffer(cll.commandQueue, cll.CLbuffer0, true, 0, 32, cll.cldata, 0, NULL, NULL);
-
-            if (status != CL_SUCCESS) {
-                printf("EnqueueWriteBuffer failed %d", status);
-                exit(1);
-            }
-            pnonces[0] = 0xffffffffffffffff;
-            clEnqueueWriteBuffer(cll.commandQueue, cll.outputBuffer, CL_TRUE, 0, sizeof(uint64_t), pnonces, 0, NULL, NULL);
-
-            // init - search
-            clSetKernelArg(cll.kernel[0], 0, sizeof(cl_mem), (void *)&cll.buffer1);
-            clSetKernelArg(cll.kernel[0], 1, sizeof(cl_mem), (void *)&cll.CLbuffer0);
-            clSetKernelArg(cll.kernel[0], 2, sizeof(uint64_t), &(s_nonce));
-
-            // fill - search 1
-            size_t bufferSize = 32 * 8 * 1 * sizeof(cl_uint) * 2;
-            uint32_t passes = 1;
-            uint32_t lanes = 1;
-            uint32_t segment_blocks = 2;
-
-            clSetKernelArg(cll.kernel[1], 0, bufferSize, NULL);
-            clSetKernelArg(cll.kernel[1], 1, sizeof(cll.buffer1), (void *)&cll.buffer1);
-            clSetKernelArg(cll.kernel[1], 2, sizeof(uint32_t), &passes);
-            clSetKernelArg(cll.kernel[1], 3, sizeof(uint32_t), &lanes);
-            clSetKernelArg(cll.kernel[1], 4, sizeof(uint32_t), &segment_blocks);
-
-            // final - search 2
-            size_t smem = 129 * sizeof(cl_ulong) * 8 + 18 * sizeof(cl_ulong) * 8;
-            clSetKernelArg(cll.kernel[2], 0, sizeof(cll.buffer1), (void *)&cll.buffer1);
-            clSetKernelArg(cll.kernel[2], 1, sizeof(cll.outputBuffer), (void *)&cll.outputBuffer);
-            clSetKernelArg(cll.kernel[2], 2, smem, NULL);
-            clSetKernelArg(cll.kernel[2], 3, sizeof(uint64_t), &(s_nonce));
-            clSetKernelArg(cll.kernel[2], 4, sizeof(cl_ulong), &le_target);
-
-            const size_t global[1] = {throughput};
-            const size_t local[1] = {64};
-
-            status = clEnqueueNDRangeKernel(cll.commandQueue, cll.kernel[0], 1, NULL, global, local, 0, NULL, NULL);
-
-            if (status != CL_SUCCESS) {
-                printf("lEnqueueNDRangeKernel[0] (%d). Build log follows:\n", status);
-                get_program_build_log(cll.program, dev_id);
-                fflush(stdout);
-                exit(1);
-            }
-            clFinish(cll.commandQueue);
-            const size_t global2[1] = {throughput * 32};
-            const size_t local2[1] = {32};
-            status = clEnqueueNDRangeKernel(cll.commandQueue, cll.kernel[1], 1, NULL, global2, local2, 0, NULL, NULL);
-
-            if (status != CL_SUCCESS) {
-                printf("lEnqueueNDRangeKernel[1] (%d). Build log follows:\n", status);
-                get_program_build_log(cll.program, dev_id);
-                fflush(stdout);
-                exit(1);
-            }
-            clFinish(cll.commandQueue);
-
-            const size_t global3[2] = {4, throughput};
-            const size_t local3[2] = {4, 8};
-            status = clEnqueueNDRangeKernel(cll.commandQueue, cll.kernel[2], 2, NULL, global3, local3, 0, NULL, NULL);
+        // on new work, batches queued for the old one are preempted before waiting on them
+        for (size_t source = 0; source < workSourceCount(); source++) {
+            preemptOlderWork(cll, source, currentWorkEpoch(source));
+        }
 
-            if (status != CL_SUCCESS) {
-                printf("lEnqueueNDRangeKernel[2] (%d). Build log follows:\n", status);
-                get_program_build_log(cll.program, dev_id);
-                fflush(stdout);
-                exit(1);
-            }
-            clFinish(cll.commandQueue);
-
-            check_clEnqueueReadBuffer(cll.commandQueue, cll.outputBuffer,
-                                      CL_TRUE,               // cl_bool blocking_read
-                                      0,                     // size_t offset
-                                      sizeof(uint64_t) * 1,  // size_t size
-                                      pnonces,               // void *ptr
-                                      0,                     // cl_uint num_events_in_wait_list
-                                      NULL,                  // cl_event *event_wait_list
-                                      NULL);
-
-            if (pnonces[0] != 0xffffffffffffffff) {
-                s_nonce = pnonces[0];
-                hash(prms, mpz_result, s_nonce, s_ctx);
-            }
-            s_nonce += throughput;
-            s_threadHashes += throughput;
-            s_totalHashes += throughput;
+        BatchSlot &slot = slots[oldest];
+        if (slot.inFlight) {
+            completeBatch(slot, batchCfg.throughput);
+        }
+        if (prepareBatch(slot, minerID, solo, batchCfg.throughput)) {
+            // work may have changed again since the loop start
+            preemptOlderWork(cll, slot.work->source, slot.work->epoch);
+            enqueueBatch(cll, dev_id, slot, batchCfg);
         }
+        oldest = (oldest + 1) % slots.size();
+    }
+
+    // drain batches still in flight
+    clFinish(cll.commandQueue);
+    releasePreemption(cll);
+    for (auto &slot : slots) {
+        if (slot.readDone)
+            clReleaseEvent(slot.readDone);
+        clReleaseMemObject(slot.buffer1);
+        clReleaseMemObject(slot.CLbuffer0);
+        clReleaseMemObject(slot.outputBuffer);
+        clReleaseMemObject(slot.targetBuffer);
     }
     freeCurrentThreadMiningMemory();
 }
@@ -821,6 +1798,8 @@ void startMinerThreads(int gpuMiners) {
     assert(s_minerThreads.size() == 0);
     s_minerThreads.resize(gpuMiners);
     s_minerThreadsInfo.resize(gpuMiners);
+    startSubmitQueue(SUBMIT_WORKERS, submitShares);
+    openShareJournal(s_configDir + SHARE_JOURNAL_FILE_NAME);
     for (int i = 0; i < gpuMiners; i++) {
         s_minerThreads[i] = new std::thread(minerThreadFn, i);
     }
@@ -834,5 +1813,7 @@ void stopMinerThreads() {
         delete s_minerThreads[i];
     }
     s_minerThreads.clear();
-    destroyHttpConnectionHandle(s_httpHandleSubmit);
+    // shares still queued are submitted before exiting
+    stopSubmitQueue();
+    closeShareJournal();
 }
@@ -20,9 +20,31 @@ struct WorkParams {
     mpz_t mpz_target;
 };
 
+// immutable binary snapshot of a work, built once by the update thread & shared by miner threads
+struct WorkDescriptor {
+    // increases with each new work, 0 means no work yet
+    uint64_t epoch = 0;
+    // header hash, first 32 bytes of the argon2 seed
+    uint8_t header[32] = {0};
+    // 256 bits target, big endian
+    uint8_t target[32] = {0};
+    // same target as 4 words, most significant first (search2 layout)
+    uint64_t deviceTarget[4] = {0};
+    // hex header hash, as sent back on submit
+    std::string hash;
+    // pool / node the work comes from, its shares are submitted there
+    std::string url;
+    // work source index (--split), epochs of different sources are unrelated
+    uint32_t source = 0;
+};
+
 void startMinerThreads(int nThreads);
 void stopMinerThreads();
 
+// submits journaled shares that could not be sent, if their work is still current
+// called by the update thread after each successful getWork
+void replayUnsentShares();
+
 uint32_t getTotalHashes();
 uint32_t getTotalSharesSubmitted();
 uint32_t getTotalSharesAccepted();
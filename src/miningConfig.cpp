@@ -6,6 +6,7 @@
 
 #include "hardware_utils.h"
 #include "log.h"
+#include "string_utils.h"
 #include "updateThread.h"
 
 static MiningConfig s_cfg;
@@ -15,12 +16,33 @@ void initMiningConfig() {
     s_cfg.getWorkUrl = s_cfg.defaultSubmitWorkUrl;
     s_cfg.soloMine = false;
     s_cfg.refreshRateMs = 3000;
+    s_cfg.pipelineDepth = 2;
+    s_cfg.kernelCache = true;
+    s_cfg.autotune = false;
+    s_cfg.cpuVerifyInterval = 0;
+    s_cfg.longPoll = true;
+    s_cfg.proxyServerPort = 0;
+    s_cfg.proxyServerBind = "127.0.0.1";
     getGpuDevices(s_cfg.gpuIds);
 }
 
+std::vector<std::string> splitWorkUrls(const std::string &urls) {
+    std::vector<std::string> res;
+    for (const auto &url : split(urls, ',')) {
+        if (trim(url).size() > 0) {
+            res.push_back(trim(url));
+        }
+    }
+    return res;
+}
+
 void setMiningConfig(MiningConfig cfg) {
+    // split url list
+    cfg.workUrls = splitWorkUrls(cfg.getWorkUrl);
+    assert(cfg.workUrls.size() > 0);
+    cfg.getWorkUrl = cfg.workUrls[0];
+
     // set submit work url
-    assert(cfg.getWorkUrl.size() > 0);
     cfg.submitWorkUrl = cfg.getWorkUrl;
 
     // solo, submit & request urls are the same
@@ -6,12 +6,34 @@
 #include <string>
 #include <vector>
 
+// max pools mined at the same time with --split
+const size_t MAX_WORK_SOURCES = 8;
+
 struct MiningConfig {
     bool soloMine;
     // List of gpu devices to use.
     std::vector<cl_device_id*> gpuIds;
     uint32_t refreshRateMs;
+    // number of gpu batches queued at the same time on each device
+    uint32_t pipelineDepth;
+    // reuse compiled kernel binaries from previous runs
+    bool kernelCache;
+    // measure best batch / work group sizes of each device at startup, and save them for later runs
+    bool autotune;
+    // re-hash 1 in n gpu results on cpu before submitting them, 0 disables it
+    uint32_t cpuVerifyInterval;
+    // use long polling for getWork when the server supports it
+    bool longPoll;
+    // --proxy-server: local port serving work to other miners, 0 when disabled
+    uint16_t proxyServerPort;
+    // --proxy-bind: ipv4 address the proxy server listens on, loopback by default
+    std::string proxyServerBind;
 
+    // every url given to -F (comma separated list), getWorkUrl is the first one
+    // solo: work is requested from all nodes at once, blocks are submitted to all of them
+    std::vector<std::string> workUrls;
+    // --split: weights of workUrls mined at the same time, empty when not splitting
+    std::vector<uint32_t> workWeights;
     std::string getWorkUrl;
     std::string submitWorkUrl;
     std::string submitWorkUrl2;
@@ -24,3 +46,6 @@ const MiningConfig& miningConfig();
 
 // do not call that during mining, only during init !
 void setMiningConfig(MiningConfig cfg);
+
+// urls of a comma separated list (-F), trimmed, empty ones dropped: what setMiningConfig puts in workUrls
+std::vector<std::string> splitWorkUrls(const std::string& urls);
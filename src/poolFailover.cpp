@@ -0,0 +1,191 @@
+#include "poolFailover.h"
+
+#include <assert.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "log.h"
+
+const char* POOL_FAILOVER_LOG_PREFIX = "POOL";
+
+// consecutive errors of the active pool before switching to a standby
+const uint32_t FAILOVER_AFTER_ERRORS = 2;
+// consecutive successful probes of a preferred pool before going back to it
+const uint32_t FAILBACK_AFTER_SUCCESSES = 4;
+// below usual server keep alive timeouts, so standby connections stay open
+const auto STANDBY_PROBE_INTERVAL = std::chrono::seconds(15);
+// weight of the last request in rtt & error rate averages
+const double HEALTH_EWMA_WEIGHT = 0.2;
+// a pool failing every request scores like a pool 10x slower
+const double ERROR_RATE_PENALTY = 10.;
+
+struct PoolHealth {
+    std::string url;
+    // one request at a time on the pool connection
+    std::mutex connectionMutex;
+
+    // guarded by s_poolsMutex
+    double rttMs = 0.;
+    double errorRate = 0.;
+    bool measured = false;
+    uint32_t consecutiveErrors = 0;
+    uint32_t consecutiveSuccesses = 0;
+    // left after errors, only such pools are failed back to
+    bool failedOver = false;
+    std::chrono::steady_clock::time_point lastRequest;
+};
+
+static std::mutex s_poolsMutex;
+static std::vector<std::unique_ptr<PoolHealth>> s_pools;
+static std::atomic<size_t> s_activePool(0);
+
+static PoolProbe s_probe = nullptr;
+static std::thread* s_pProbeThread = nullptr;
+static std::atomic<bool> s_probeRun(false);
+static std::mutex s_probeWaitMutex;
+static std::condition_variable s_probeWaitCv;
+
+// lower is better, pools that never answered come last
+static double poolScore(const PoolHealth& p) {
+    if (!p.measured)
+        return std::numeric_limits<double>::max();
+    return p.rttMs * (1. + ERROR_RATE_PENALTY * p.errorRate);
+}
+
+// called with s_poolsMutex held
+static void switchPool(size_t pool, const char* reason) {
+    size_t previous = s_activePool;
+    s_activePool = pool;
+    logLine(POOL_FAILOVER_LOG_PREFIX, "%s from %s to %s (rtt %.0fms, errors %.0f%%)",
+            reason,
+            s_pools[previous]->url.c_str(),
+            s_pools[pool]->url.c_str(),
+            s_pools[pool]->rttMs,
+            s_pools[pool]->errorRate * 100.);
+}
+
+// called with s_poolsMutex held, after a request on pool
+static void updateActivePool(size_t pool) {
+    size_t active = s_activePool;
+    PoolHealth& p = *s_pools[pool];
+    if (pool == active && p.consecutiveErrors >= FAILOVER_AFTER_ERRORS) {
+        // healthiest standby, a failing one is only used if all standbys fail
+        size_t best = active;
+        for (size_t i = 0; i < s_pools.size(); i++) {
+            if (i == active)
+                continue;
+            if (best == active) {
+                best = i;
+                continue;
+            }
+            bool healthy = s_pools[i]->consecutiveErrors == 0;
+            bool bestHealthy = s_pools[best]->consecutiveErrors == 0;
+            if (healthy != bestHealthy ? healthy : poolScore(*s_pools[i]) < poolScore(*s_pools[best]))
+                best = i;
+        }
+        if (best != active) {
+            s_pools[active]->failedOver = true;
+            switchPool(best, "failing over");
+        }
+    } else if (pool < active && p.failedOver && p.consecutiveSuccesses >= FAILBACK_AFTER_SUCCESSES) {
+        p.failedOver = false;
+        switchPool(pool, "failing back");
+    }
+}
+
+bool poolRequest(size_t pool, const std::function<bool()>& request) {
+    PoolHealth& p = *s_pools[pool];
+    bool ok;
+    double rttMs;
+    {
+        std::lock_guard<std::mutex> lock(p.connectionMutex);
+        auto tStart = std::chrono::steady_clock::now();
+        ok = request();
+        rttMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - tStart).count();
+    }
+
+    std::lock_guard<std::mutex> lock(s_poolsMutex);
+    p.lastRequest = std::chrono::steady_clock::now();
+    p.errorRate += HEALTH_EWMA_WEIGHT * ((ok ? 0. : 1.) - p.errorRate);
+    if (ok) {
+        p.rttMs = p.measured ? p.rttMs + HEALTH_EWMA_WEIGHT * (rttMs - p.rttMs) : rttMs;
+        p.measured = true;
+        p.consecutiveErrors = 0;
+        p.consecutiveSuccesses++;
+    } else {
+        p.consecutiveErrors++;
+        p.consecutiveSuccesses = 0;
+    }
+    updateActivePool(pool);
+    return ok;
+}
+
+// requests standbys regularly, first probes are done right away to open their connections
+static void probeThreadFn() {
+    while (s_probeRun) {
+        for (size_t i = 0; i < s_pools.size() && s_probeRun; i++) {
+            bool due;
+            {
+                std::lock_guard<std::mutex> lock(s_poolsMutex);
+                due = i != s_activePool &&
+                      std::chrono::steady_clock::now() - s_pools[i]->lastRequest >= STANDBY_PROBE_INTERVAL;
+            }
+            if (due) {
+                poolRequest(i, [i] { return s_probe(s_pools[i]->url); });
+            }
+        }
+        std::unique_lock<std::mutex> lock(s_probeWaitMutex);
+        s_probeWaitCv.wait_for(lock, std::chrono::seconds(1), [] { return !s_probeRun; });
+    }
+}
+
+void startPoolFailover(const std::vector<std::string>& urls, PoolProbe probe) {
+    assert(!s_pProbeThread && urls.size() > 0);
+    for (const auto& url : urls) {
+        s_pools.emplace_back(new PoolHealth());
+        s_pools.back()->url = url;
+    }
+    s_activePool = 0;
+    s_probe = probe;
+    if (s_pools.size() > 1) {
+        s_probeRun = true;
+        s_pProbeThread = new std::thread(probeThreadFn);
+    }
+}
+
+void stopPoolFailover() {
+    if (s_pProbeThread) {
+        {
+            std::lock_guard<std::mutex> lock(s_probeWaitMutex);
+            s_probeRun = false;
+        }
+        s_probeWaitCv.notify_all();
+        s_pProbeThread->join();
+        delete s_pProbeThread;
+        s_pProbeThread = nullptr;
+    }
+    s_pools.clear();
+}
+
+size_t activePool() {
+    return s_activePool;
+}
+
+const std::string& poolUrl(size_t pool) {
+    return s_pools[pool]->url;
+}
+
+bool allPoolsDown() {
+    std::lock_guard<std::mutex> lock(s_poolsMutex);
+    for (const auto& p : s_pools) {
+        if (p->consecutiveErrors == 0)
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// pool mining with several -F urls: getWork goes to one active pool, the others are standbys
+// standbys are probed regularly, which keeps their connection alive & measures their health
+
+// getWork on url, returns false on error
+typedef bool (*PoolProbe)(const std::string& url);
+
+/**
+ * @brief Starts with the first pool active, and the standby probing thread.
+ */
+void startPoolFailover(const std::vector<std::string>& urls, PoolProbe probe);
+void stopPoolFailover();
+
+size_t activePool();
+const std::string& poolUrl(size_t pool);
+
+/**
+ * @brief Runs request on the connection of pool (never used by 2 threads at once) and records its health.
+ *
+ * Fails over to the healthiest standby after repeated errors of the active pool,
+ * fails back to a pool left after errors (earlier in the list) once it has been healthy for a while.
+ * @return result of request.
+ */
+bool poolRequest(size_t pool, const std::function<bool()>& request);
+
+// true when every pool failed its last requests
+bool allPoolsDown();
@@ -0,0 +1,187 @@
+#include "programCache.h"
+
+#include <openssl/sha.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include "log.h"
+#include "miningConfig.h"
+
+extern std::string s_configDir;
+
+// bump when the file layout changes
+static const char CACHE_MAGIC[8] = {'A', 'Q', 'C', 'L', 'B', 'I', 'N', '1'};
+
+std::string deviceInfoString(cl_device_id device, cl_device_info param) {
+    size_t len = 0;
+    if (clGetDeviceInfo(device, param, 0, NULL, &len) != CL_SUCCESS || len == 0)
+        return "";
+    std::vector<char> value(len, 0);
+    clGetDeviceInfo(device, param, len, value.data(), NULL);
+    return std::string(value.data());
+}
+
+static std::string toHex(const uint8_t* bytes, size_t count) {
+    static const char* DIGITS = "0123456789abcdef";
+    std::string res;
+    for (size_t i = 0; i < count; i++) {
+        res.push_back(DIGITS[bytes[i] >> 4]);
+        res.push_back(DIGITS[bytes[i] & 0xf]);
+    }
+    return res;
+}
+
+static std::string sha256Hex(const std::string& data) {
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256((const uint8_t*)data.data(), data.size(), digest);
+    return toHex(digest, sizeof(digest));
+}
+
+std::string deviceIdentity(cl_device_id device) {
+    return deviceInfoString(device, CL_DEVICE_NAME) + "/" + deviceInfoString(device, CL_DRIVER_VERSION);
+}
+
+static std::string cacheKey(cl_device_id device, const char* source, size_t sourceLen, const std::string& options) {
+    std::string keyData = deviceIdentity(device);
+    keyData += "\n" + options + "\n";
+    keyData += sha256Hex(std::string(source, sourceLen));
+    return sha256Hex(keyData);
+}
+
+static std::string cacheFilePath(const std::string& key) {
+    return s_configDir + "kernel_" + key.substr(0, 16) + ".bin";
+}
+
+// file layout: magic | key (64 hex chars) | binary size (u64) | sha256 of binary | binary
+static bool loadCachedBinary(const std::string& key, std::vector<uint8_t>& binary) {
+    std::ifstream fs(cacheFilePath(key), std::ios::binary);
+    if (!fs.is_open())
+        return false;
+
+    char magic[sizeof(CACHE_MAGIC)];
+    char fileKey[64];
+    uint64_t size = 0;
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    fs.read(magic, sizeof(magic));
+    fs.read(fileKey, sizeof(fileKey));
+    fs.read((char*)&size, sizeof(size));
+    fs.read((char*)digest, sizeof(digest));
+    if (!fs ||
+        memcmp(magic, CACHE_MAGIC, sizeof(magic)) ||
+        key.compare(0, key.size(), fileKey, sizeof(fileKey)) ||
+        size == 0 || size > (256u << 20)) {
+        return false;
+    }
+
+    binary.resize((size_t)size);
+    fs.read((char*)binary.data(), binary.size());
+    if (!fs)
+        return false;
+
+    uint8_t check[SHA256_DIGEST_LENGTH];
+    SHA256(binary.data(), binary.size(), check);
+    return memcmp(check, digest, sizeof(digest)) == 0;
+}
+
+static void saveCachedBinary(const char* logPrefix, const std::string& key, cl_program program) {
+    size_t size = 0;
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL) != CL_SUCCESS || size == 0)
+        return;
+    std::vector<uint8_t> binary(size);
+    uint8_t* pBinary = binary.data();
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(pBinary), &pBinary, NULL) != CL_SUCCESS)
+        return;
+
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256(binary.data(), binary.size(), digest);
+    uint64_t size64 = size;
+
+    // write to a temp file first, several miner threads may build for the same device model
+    std::string path = cacheFilePath(key);
+    std::string tmpPath = path + "." + std::to_string((uintptr_t)program) + ".tmp";
+    {
+        std::ofstream fs(tmpPath, std::ios::binary | std::ios::trunc);
+        if (!fs.is_open()) {
+            logLine(logPrefix, "Warning: cannot write kernel cache file %s", tmpPath.c_str());
+            return;
+        }
+        fs.write(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+        fs.write(key.data(), key.size());
+        fs.write((const char*)&size64, sizeof(size64));
+        fs.write((const char*)digest, sizeof(digest));
+        fs.write((const char*)binary.data(), binary.size());
+        if (!fs) {
+            fs.close();
+            remove(tmpPath.c_str());
+            return;
+        }
+    }
+    remove(path.c_str());
+    if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+        remove(tmpPath.c_str());
+    }
+}
+
+static void printBuildLog(cl_program program, cl_device_id device) {
+    size_t len = 0;
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &len);
+    std::vector<char> buffer(len + 1, 0);
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, len, buffer.data(), NULL);
+    printf("%s\n", buffer.data());
+}
+
+cl_program buildProgramCached(
+    const char* logPrefix,
+    cl_context context,
+    cl_device_id device,
+    const char* source,
+    size_t sourceLen,
+    const std::string& options) {
+    cl_int status;
+    bool useCache = miningConfig().kernelCache;
+    std::string key = cacheKey(device, source, sourceLen, options);
+
+    // try cached binary first
+    std::vector<uint8_t> binary;
+    if (useCache && loadCachedBinary(key, binary)) {
+        const uint8_t* pBinary = binary.data();
+        size_t binarySize = binary.size();
+        cl_int binaryStatus = CL_SUCCESS;
+        cl_program program = clCreateProgramWithBinary(context, 1, &device, &binarySize, &pBinary, &binaryStatus, &status);
+        if (status == CL_SUCCESS && binaryStatus == CL_SUCCESS && program) {
+            status = clBuildProgram(program, 1, &device, options.c_str(), NULL, NULL);
+            if (status == CL_SUCCESS) {
+                logLine(logPrefix, "Kernel loaded from cache");
+                return program;
+            }
+        }
+        if (program) {
+            clReleaseProgram(program);
+        }
+        logLine(logPrefix, "Kernel cache entry rejected by driver (%d), rebuilding from source", status);
+    }
+
+    // build from source
+    cl_program program = clCreateProgramWithSource(context, 1, &source, &sourceLen, &status);
+    if (status != CL_SUCCESS || !program) {
+        printf("clCreateProgramWithSource (%d)\n", status);
+        return nullptr;
+    }
+    status = clBuildProgram(program, 1, &device, options.c_str(), NULL, NULL);
+    if (status != CL_SUCCESS) {
+        printf("OpenCL build failed (%d). Build log follows:\n", status);
+        printBuildLog(program, device);
+        fflush(stdout);
+        clReleaseProgram(program);
+        return nullptr;
+    }
+
+    if (useCache) {
+        saveCachedBinary(logPrefix, key, program);
+    }
+    return program;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <CL/cl.h>
+
+#include <string>
+
+/**
+ * @brief Creates and builds an OpenCL program for one device, going through the on-disk binary cache.
+ *
+ * Cache entries are keyed on device name, driver version, build options and a hash of the source.
+ * On a cache miss, or when the cached binary is rejected by the driver, the program is built from
+ * source and the resulting binary is written back to the cache.
+ *
+ * @param logPrefix Prefix used for log lines.
+ * @return cl_program The built program, nullptr if the source build failed (build log is printed).
+ */
+cl_program buildProgramCached(
+    const char* logPrefix,
+    cl_context context,
+    cl_device_id device,
+    const char* source,
+    size_t sourceLen,
+    const std::string& options);
+
+/**
+ * @brief Returns "<device name>/<driver version>" for the device, used to key per-device files.
+ */
+std::string deviceIdentity(cl_device_id device);
+
+// string device info (name, extensions ...), empty on error
+std::string deviceInfoString(cl_device_id device, cl_device_info param);
@@ -0,0 +1,400 @@
+#include "proxyServer.h"
+
+#include <rapidjson/document.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "http.h"
+#include "log.h"
+#include "miningConfig.h"
+#include "tcpSocket.h"
+#include "updateThread.h"
+#include "webSocket.h"
+
+#undef GetObject
+
+using namespace rapidjson;
+
+const char* PROXY_LOG_PREFIX = "PRXY";
+
+// advertised to downstream miners in the X-Long-Polling header
+const std::string PROXY_LONG_POLL_PATH = "/longpoll";
+// answered before the 90s long poll timeout of miners
+const auto PROXY_LONG_POLL_WAIT = std::chrono::seconds(60);
+// idle keep alive connections are closed after that
+const int PROXY_IDLE_TIMEOUT_MS = 120 * 1000;
+// max delay before connection threads notice the server stops
+const int PROXY_POLL_MS = 500;
+const size_t PROXY_MAX_REQUEST_SIZE = 1024 * 1024;
+// persistent upstream connections kept open for forwarded requests
+const size_t PROXY_UPSTREAM_CONNECTIONS = 4;
+// only calls made by miners are served, anything else could reach admin apis of the node
+const char* PROXY_ALLOWED_METHODS[] = {"aqua_getWork", "aqua_submitWork", "aqua_getBlockByNumber"};
+
+static std::atomic<bool> s_proxyRun(false);
+static socket_t s_listenSock = INVALID_SOCKET;
+static std::thread* s_pAcceptThread = nullptr;
+static std::atomic<uint32_t> s_activeConnections(0);
+
+static std::mutex s_upstreamMutex;
+static std::vector<http_connection_handle_t> s_idleUpstream;
+
+struct HttpRequest {
+    std::string path;
+    std::vector<std::string> headers;
+    std::string body;
+};
+
+// reads the next request of a keep alive connection, false on close, error or idle timeout
+static bool readRequest(socket_t sock, std::string& buffer, HttpRequest& req) {
+    int idleMs = 0;
+    size_t headersEnd;
+    while ((headersEnd = buffer.find("\r\n\r\n")) == std::string::npos) {
+        if (!s_proxyRun || idleMs >= PROXY_IDLE_TIMEOUT_MS || buffer.size() > PROXY_MAX_REQUEST_SIZE)
+            return false;
+        if (!waitReadable(sock, PROXY_POLL_MS)) {
+            idleMs += PROXY_POLL_MS;
+            continue;
+        }
+        if (!receiveSome(sock, buffer))
+            return false;
+    }
+
+    // request line: POST /path HTTP/1.1
+    std::vector<std::string> lines;
+    size_t lineStart = 0;
+    while (lineStart < headersEnd) {
+        size_t lineEnd = buffer.find("\r\n", lineStart);
+        lines.push_back(buffer.substr(lineStart, lineEnd - lineStart));
+        lineStart = lineEnd + 2;
+    }
+    if (lines.empty())
+        return false;
+    size_t pathStart = lines[0].find(' ');
+    size_t pathEnd = lines[0].find(' ', pathStart + 1);
+    if (pathStart == std::string::npos || pathEnd == std::string::npos)
+        return false;
+    req.path = lines[0].substr(pathStart + 1, pathEnd - pathStart - 1);
+    req.headers.assign(lines.begin() + 1, lines.end());
+
+    size_t bodySize = (size_t)atol(findHttpHeader(req.headers, "Content-Length").c_str());
+    if (bodySize > PROXY_MAX_REQUEST_SIZE)
+        return false;
+    size_t bodyStart = headersEnd + 4;
+    while (buffer.size() < bodyStart + bodySize) {
+        if (!s_proxyRun || !waitReadable(sock, PROXY_IDLE_TIMEOUT_MS) || !receiveSome(sock, buffer))
+            return false;
+    }
+    req.body = buffer.substr(bodyStart, bodySize);
+    buffer.erase(0, bodyStart + bodySize);
+    return true;
+}
+
+static bool sendResponse(socket_t sock, const std::string& body) {
+    std::string response =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: application/json\r\n"
+        "X-Long-Polling: " + PROXY_LONG_POLL_PATH + "\r\n"
+        "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+    return sendAll(sock, response.c_str(), response.size());
+}
+
+static std::string rpcError(const std::string& id, const char* message) {
+    return "{\"jsonrpc\":\"2.0\", \"id\" : " + id + ", \"error\" : {\"code\" : -32000, \"message\" : \"" + message + "\"}}";
+}
+
+// same answer as the upstream getWork: [header hash, seed hash (unused by aqua), target]
+static std::string workResponse(const std::string& id, const WorkDescriptor& work) {
+    static const char* HEX = "0123456789abcdef";
+    std::string target = "0x";
+    for (uint8_t b : work.target) {
+        target += HEX[b >> 4];
+        target += HEX[b & 0xf];
+    }
+    return "{\"jsonrpc\":\"2.0\", \"id\" : " + id + ", \"result\" : [\"" + work.hash +
+           "\",\"0x0000000000000000000000000000000000000000000000000000000000000000\",\"" + target + "\"]}";
+}
+
+// forwards a request as is, on one of the persistent upstream connections
+static bool forwardUpstream(const std::string& url, const std::string& body, std::string& response) {
+    if (isWebSocketUrl(url)) {
+        return webSocketRpc(url, body, response);
+    }
+    const std::vector<std::string> HTTP_HEADER = {
+        "Accept: application/json",
+        "Content-Type: application/json"};
+
+    http_connection_handle_t handle = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(s_upstreamMutex);
+        if (s_idleUpstream.size()) {
+            handle = s_idleUpstream.back();
+            s_idleUpstream.pop_back();
+        }
+    }
+    if (!handle) {
+        handle = newHttpConnectionHandle();
+    }
+    bool ok = httpPost(handle, url, body, response, &HTTP_HEADER);
+    {
+        std::lock_guard<std::mutex> lock(s_upstreamMutex);
+        if (s_idleUpstream.size() < PROXY_UPSTREAM_CONNECTIONS) {
+            s_idleUpstream.push_back(handle);
+            handle = nullptr;
+        }
+    }
+    if (handle) {
+        destroyHttpConnectionHandle(handle);
+    }
+    return ok;
+}
+
+// upstream of a submit: the source whose work has this hash
+static std::string submitUrl(const std::string& workHash) {
+    for (size_t source = 0; source < workSourceCount(); source++) {
+        auto work = currentWork(source);
+        if (work && work->hash == workHash && work->url.size()) {
+            return work->url;
+        }
+    }
+    return miningConfig().submitWorkUrl;
+}
+
+// method of a json rpc call, empty if it is not one
+static std::string callMethod(const Value& call) {
+    if (!call.IsObject() || !call.HasMember("method") || !call["method"].IsString())
+        return "";
+    return call["method"].GetString();
+}
+
+static bool isAllowedMethod(const std::string& method) {
+    for (const char* allowed : PROXY_ALLOWED_METHODS) {
+        if (method == allowed)
+            return true;
+    }
+    return false;
+}
+
+// id of a json rpc call or response, as it is written in json
+static std::string callId(const Value& call) {
+    if (call.IsObject() && call.HasMember("id") && call["id"].IsInt64())
+        return std::to_string(call["id"].GetInt64());
+    return "null";
+}
+
+static std::string toJson(const Value& value) {
+    StringBuffer buffer;
+    Writer<StringBuffer> writer(buffer);
+    value.Accept(writer);
+    return buffer.GetString();
+}
+
+// getWork answered from memory, primary source only: --split is refused with --proxy-server
+// servedEpoch: last work epoch sent on this connection, long polls wait for a newer one
+static std::string serveWork(const std::string& id, bool longPoll, uint64_t& servedEpoch) {
+    if (longPoll) {
+        auto deadline = std::chrono::steady_clock::now() + PROXY_LONG_POLL_WAIT;
+        while (s_proxyRun && currentWorkEpoch() == servedEpoch && std::chrono::steady_clock::now() < deadline) {
+            waitWorkEpoch(servedEpoch, std::chrono::milliseconds(PROXY_POLL_MS));
+        }
+    }
+    auto work = currentWork();
+    if (!work) {
+        return rpcError(id, "no work yet");
+    }
+    servedEpoch = work->epoch;
+    return workResponse(id, *work);
+}
+
+// upstream of a forwarded call: submits go to the source of their work, block info to the node if there is one
+static std::string upstreamUrl(const Value& call) {
+    const MiningConfig& cfg = miningConfig();
+    if (callMethod(call) == "aqua_submitWork") {
+        const Value& params = call.HasMember("params") ? call["params"] : call;
+        bool hasHash = params.IsArray() && params.Size() >= 2 && params[1u].IsString();
+        return hasHash ? submitUrl(params[1u].GetString()) : cfg.submitWorkUrl;
+    }
+    return cfg.fullNodeUrl.size() ? cfg.fullNodeUrl : cfg.getWorkUrl;
+}
+
+// forwards the calls of a batch that have the same upstream, in one request (a batch if several),
+// responses[i] receives the response of batch[i]
+static void forwardCalls(const std::string& url, const Value& batch, const std::vector<SizeType>& calls, std::vector<std::string>& responses) {
+    std::string body;
+    for (size_t i = 0; i < calls.size(); i++) {
+        body += (i ? "," : "") + toJson(batch[calls[i]]);
+    }
+    if (calls.size() > 1) {
+        body = "[" + body + "]";
+    }
+    std::string response;
+    Document doc;
+    if (forwardUpstream(url, body, response)) {
+        doc.Parse(response.c_str());
+    }
+    if (calls.size() == 1 && doc.IsObject()) {
+        responses[calls[0]] = response;
+        return;
+    }
+    // responses of a batch may come in any order, the ones out of place are matched by id
+    for (size_t i = 0; i < calls.size(); i++) {
+        std::string id = callId(batch[calls[i]]);
+        std::string answer;
+        if (doc.IsArray() && doc.Size() == calls.size() && callId(doc[SizeType(i)]) == id) {
+            answer = toJson(doc[SizeType(i)]);
+        } else if (doc.IsArray()) {
+            for (const auto& r : doc.GetArray()) {
+                if (callId(r) == id) {
+                    answer = toJson(r);
+                    break;
+                }
+            }
+        }
+        responses[calls[i]] = answer.size() ? answer : rpcError(id, "upstream not responding");
+    }
+}
+
+static std::string handleRequest(const HttpRequest& req, const std::string& peer, uint64_t& servedEpoch) {
+    Document doc;
+    doc.Parse(req.body.c_str());
+
+    // batch: refused if one of its calls is not allowed, else split like single calls:
+    // getWork from memory (no long poll), other calls grouped by upstream, responses in request order
+    if (doc.IsArray()) {
+        if (doc.Empty()) {
+            return rpcError("null", "invalid request");
+        }
+        for (const auto& call : doc.GetArray()) {
+            std::string method = callMethod(call);
+            if (!isAllowedMethod(method)) {
+                logLine(PROXY_LOG_PREFIX, "refused batch from %s, method not allowed: %s", peer.c_str(), method.c_str());
+                return rpcError("null", "method not allowed");
+            }
+        }
+        std::vector<std::string> responses(doc.Size());
+        std::vector<std::pair<std::string, std::vector<SizeType>>> upstreams;
+        for (SizeType i = 0; i < doc.Size(); i++) {
+            if (callMethod(doc[i]) == "aqua_getWork") {
+                responses[i] = serveWork(callId(doc[i]), false, servedEpoch);
+                continue;
+            }
+            std::string url = upstreamUrl(doc[i]);
+            auto upstream = std::find_if(upstreams.begin(), upstreams.end(), [&](const auto& u) { return u.first == url; });
+            if (upstream == upstreams.end()) {
+                upstream = upstreams.insert(upstreams.end(), {url, {}});
+            }
+            upstream->second.push_back(i);
+        }
+        for (const auto& upstream : upstreams) {
+            forwardCalls(upstream.first, doc, upstream.second, responses);
+            logLine(PROXY_LOG_PREFIX, "%u calls of a batch from %s forwarded to %s",
+                    (unsigned)upstream.second.size(), peer.c_str(), upstream.first.c_str());
+        }
+        std::string response = "[";
+        for (size_t i = 0; i < responses.size(); i++) {
+            response += (i ? "," : "") + responses[i];
+        }
+        return response + "]";
+    }
+    if (!doc.IsObject() || !doc.HasMember("method") || !doc["method"].IsString()) {
+        return rpcError("null", "invalid request");
+    }
+    std::string id = callId(doc);
+    std::string method = doc["method"].GetString();
+    if (!isAllowedMethod(method)) {
+        logLine(PROXY_LOG_PREFIX, "refused call from %s, method not allowed: %s", peer.c_str(), method.c_str());
+        return rpcError(id, "method not allowed");
+    }
+    if (method == "aqua_getWork") {
+        return serveWork(id, req.path == PROXY_LONG_POLL_PATH, servedEpoch);
+    }
+
+    std::string url = upstreamUrl(doc);
+    std::string response;
+    if (!forwardUpstream(url, req.body, response)) {
+        if (method == "aqua_submitWork") {
+            logLine(PROXY_LOG_PREFIX, "submit from %s could not be forwarded to %s", peer.c_str(), url.c_str());
+        }
+        return rpcError(id, "upstream not responding");
+    }
+    if (method == "aqua_submitWork") {
+        logLine(PROXY_LOG_PREFIX, "submit from %s forwarded to %s", peer.c_str(), url.c_str());
+    }
+    return response;
+}
+
+static void connectionThreadFn(socket_t sock, std::string peer) {
+    logLine(PROXY_LOG_PREFIX, "miner connected from %s", peer.c_str());
+    std::string buffer;
+    HttpRequest req;
+    uint64_t servedEpoch = 0;
+    while (readRequest(sock, buffer, req)) {
+        if (!sendResponse(sock, handleRequest(req, peer, servedEpoch)))
+            break;
+        std::string connection = findHttpHeader(req.headers, "Connection");
+        if (connection == "close" || connection == "Close")
+            break;
+    }
+    closeSocket(sock);
+    s_activeConnections--;
+}
+
+static void acceptThreadFn() {
+    while (s_proxyRun) {
+        if (!waitReadable(s_listenSock, PROXY_POLL_MS))
+            continue;
+        std::string peer;
+        socket_t sock = acceptTcp(s_listenSock, peer);
+        if (sock == INVALID_SOCKET)
+            continue;
+        // one thread per miner connection, a farm has a few dozen of them at most
+        s_activeConnections++;
+        std::thread(connectionThreadFn, sock, peer).detach();
+    }
+}
+
+bool startProxyServer(const std::string& address, uint16_t port) {
+    std::string error;
+    s_listenSock = listenTcp(address, port, error);
+    if (s_listenSock == INVALID_SOCKET) {
+        logLine(PROXY_LOG_PREFIX, "Error: %s", error.c_str());
+        return false;
+    }
+    s_proxyRun = true;
+    s_pAcceptThread = new std::thread(acceptThreadFn);
+    logLine(PROXY_LOG_PREFIX, "serving work to other miners on %s:%u", address.c_str(), (unsigned)proxyServerPort());
+    return true;
+}
+
+uint16_t proxyServerPort() {
+    return (s_listenSock == INVALID_SOCKET) ? 0 : localPort(s_listenSock);
+}
+
+void stopProxyServer() {
+    if (!s_pAcceptThread)
+        return;
+    s_proxyRun = false;
+    s_pAcceptThread->join();
+    delete s_pAcceptThread;
+    s_pAcceptThread = nullptr;
+    closeSocket(s_listenSock);
+    s_listenSock = INVALID_SOCKET;
+
+    // connection threads exit after their current request
+    while (s_activeConnections > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    for (auto handle : s_idleUpstream) {
+        destroyHttpConnectionHandle(handle);
+    }
+    s_idleUpstream.clear();
+}
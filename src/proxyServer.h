@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+
+// --proxy-server: serves work to other miners, so a whole farm only polls the pool once
+// aqua_getWork is answered from the work of the primary source (no --split), with long polling support
+// aqua_submitWork & block info requests are forwarded upstream over a few persistent connections,
+// calls of a batch are served the same way, each submit going to the source of its work,
+// other methods are refused (the node behind the proxy may expose admin / personal apis)
+
+/**
+ * @brief Listens on address:port (ipv4, 0.0.0.0 for all interfaces), must be called after startUpdateThread().
+ * @return false if the port cannot be opened.
+ */
+bool startProxyServer(const std::string& address, uint16_t port);
+
+// port the server listens on, the free port it picked when started with port 0
+uint16_t proxyServerPort();
+
+/**
+ * @brief Closes the server & waits for pending requests, must be called before stopUpdateThread().
+ */
+void stopProxyServer();
@@ -0,0 +1,261 @@
+#include "shareJournal.h"
+
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+#include "log.h"
+
+const char* JOURNAL_LOG_PREFIX = "JRNL";
+
+const char JOURNAL_MAGIC[8] = "AQSJRN1";
+// slots are reused once full, only unsent shares are kept when a slot is needed
+const uint32_t JOURNAL_CAPACITY = 4096;
+// unsent shares older than that are dropped when the journal is opened
+const int64_t JOURNAL_MAX_AGE_MS = 60 * 60 * 1000;
+
+enum RecordState : uint32_t {
+    RECORD_FREE = 0,
+    RECORD_QUEUED,
+    RECORD_UNSENT,
+    RECORD_DONE
+};
+
+// file layout: header | JOURNAL_CAPACITY records, fixed size so the whole file is mapped once
+struct JournalHeader {
+    char magic[8];
+    uint32_t capacity;
+    // slots used so far, records are appended until the journal is full
+    uint32_t count;
+    uint8_t reserved[48];
+};
+
+struct JournalRecord {
+    // written last, a record is only valid once its state is set
+    uint32_t state;
+    int32_t minerThreadId;
+    uint64_t nonce;
+    uint64_t epoch;
+    int64_t foundAtMs;
+    char workHash[72];
+    char url[200];
+};
+
+const size_t JOURNAL_FILE_SIZE = sizeof(JournalHeader) + JOURNAL_CAPACITY * sizeof(JournalRecord);
+
+static std::mutex s_journalMutex;
+static uint8_t* s_pMapping = nullptr;
+static JournalHeader* s_pHeader = nullptr;
+static JournalRecord* s_pRecords = nullptr;
+// next slot looked at for reuse, once the journal is full
+static uint32_t s_reuseCursor = 0;
+static std::atomic<uint32_t> s_unsentCount(0);
+
+#ifdef _WIN32
+static HANDLE s_file = INVALID_HANDLE_VALUE;
+static HANDLE s_fileMapping = NULL;
+#else
+static int s_fd = -1;
+#endif
+
+static int64_t nowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+static void copyField(char* dst, size_t dstSize, const std::string& src) {
+    size_t n = (src.size() < dstSize - 1) ? src.size() : dstSize - 1;
+    memcpy(dst, src.c_str(), n);
+    dst[n] = 0;
+}
+
+// maps the file, resized to JOURNAL_FILE_SIZE, fresh is true when it had another size
+static bool mapJournalFile(const std::string& path, bool& fresh) {
+#ifdef _WIN32
+    s_file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (s_file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER size;
+    fresh = !GetFileSizeEx(s_file, &size) || (size_t)size.QuadPart != JOURNAL_FILE_SIZE;
+    if (fresh) {
+        size.QuadPart = JOURNAL_FILE_SIZE;
+        if (!SetFilePointerEx(s_file, size, NULL, FILE_BEGIN) || !SetEndOfFile(s_file))
+            return false;
+    }
+    s_fileMapping = CreateFileMappingA(s_file, NULL, PAGE_READWRITE, 0, (DWORD)JOURNAL_FILE_SIZE, NULL);
+    if (s_fileMapping == NULL)
+        return false;
+    s_pMapping = (uint8_t*)MapViewOfFile(s_fileMapping, FILE_MAP_ALL_ACCESS, 0, 0, JOURNAL_FILE_SIZE);
+    return s_pMapping != nullptr;
+#else
+    s_fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (s_fd < 0)
+        return false;
+    struct stat st;
+    fresh = fstat(s_fd, &st) != 0 || (size_t)st.st_size != JOURNAL_FILE_SIZE;
+    if (fresh && ftruncate(s_fd, 0) != 0)
+        return false;
+    if (fresh && ftruncate(s_fd, JOURNAL_FILE_SIZE) != 0)
+        return false;
+    void* p = mmap(nullptr, JOURNAL_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, s_fd, 0);
+    if (p == MAP_FAILED)
+        return false;
+    s_pMapping = (uint8_t*)p;
+    return true;
+#endif
+}
+
+static void unmapJournalFile() {
+#ifdef _WIN32
+    if (s_pMapping) {
+        FlushViewOfFile(s_pMapping, 0);
+        UnmapViewOfFile(s_pMapping);
+    }
+    if (s_fileMapping != NULL)
+        CloseHandle(s_fileMapping);
+    if (s_file != INVALID_HANDLE_VALUE)
+        CloseHandle(s_file);
+    s_fileMapping = NULL;
+    s_file = INVALID_HANDLE_VALUE;
+#else
+    if (s_pMapping) {
+        msync(s_pMapping, JOURNAL_FILE_SIZE, MS_SYNC);
+        munmap(s_pMapping, JOURNAL_FILE_SIZE);
+    }
+    if (s_fd >= 0)
+        close(s_fd);
+    s_fd = -1;
+#endif
+    s_pMapping = nullptr;
+    s_pHeader = nullptr;
+    s_pRecords = nullptr;
+}
+
+bool openShareJournal(const std::string& path) {
+    std::lock_guard<std::mutex> lock(s_journalMutex);
+    bool fresh = true;
+    if (!mapJournalFile(path, fresh)) {
+        logLine(JOURNAL_LOG_PREFIX, "Warning: cannot map %s, found shares will not be journaled", path.c_str());
+        unmapJournalFile();
+        return false;
+    }
+    s_pHeader = (JournalHeader*)s_pMapping;
+    s_pRecords = (JournalRecord*)(s_pMapping + sizeof(JournalHeader));
+
+    bool valid = !fresh && !memcmp(s_pHeader->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) &&
+                 s_pHeader->capacity == JOURNAL_CAPACITY && s_pHeader->count <= JOURNAL_CAPACITY;
+    uint32_t kept = 0;
+    if (valid) {
+        // compaction: shares not submitted by the last run move to the front, as unsent
+        int64_t oldest = nowMs() - JOURNAL_MAX_AGE_MS;
+        for (uint32_t i = 0; i < s_pHeader->count; i++) {
+            JournalRecord& r = s_pRecords[i];
+            if ((r.state == RECORD_QUEUED || r.state == RECORD_UNSENT) && r.foundAtMs >= oldest) {
+                if (kept != i)
+                    s_pRecords[kept] = r;
+                s_pRecords[kept].state = RECORD_UNSENT;
+                kept++;
+            }
+        }
+    }
+    memset(s_pRecords + kept, 0, (JOURNAL_CAPACITY - kept) * sizeof(JournalRecord));
+    memcpy(s_pHeader->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+    s_pHeader->capacity = JOURNAL_CAPACITY;
+    s_pHeader->count = kept;
+    s_reuseCursor = 0;
+    s_unsentCount = kept;
+
+    if (kept > 0) {
+        logLine(JOURNAL_LOG_PREFIX, "%u unsent shares from last run, submitted once their work is current", kept);
+    }
+    return true;
+}
+
+void closeShareJournal() {
+    std::lock_guard<std::mutex> lock(s_journalMutex);
+    unmapJournalFile();
+    s_unsentCount = 0;
+}
+
+int64_t journalShare(uint64_t nonce, uint64_t epoch, const std::string& workHash, const std::string& url, int minerThreadId) {
+    std::lock_guard<std::mutex> lock(s_journalMutex);
+    if (!s_pHeader)
+        return -1;
+
+    // append, or reuse the next slot whose share is done once full
+    int64_t slot = -1;
+    if (s_pHeader->count < JOURNAL_CAPACITY) {
+        slot = s_pHeader->count++;
+    } else {
+        for (uint32_t n = 0; n < JOURNAL_CAPACITY && slot < 0; n++) {
+            uint32_t i = (s_reuseCursor + n) % JOURNAL_CAPACITY;
+            if (s_pRecords[i].state == RECORD_DONE || s_pRecords[i].state == RECORD_FREE)
+                slot = i;
+        }
+        if (slot < 0)
+            return -1;
+        s_reuseCursor = (uint32_t)(slot + 1) % JOURNAL_CAPACITY;
+    }
+
+    JournalRecord& r = s_pRecords[slot];
+    r.state = RECORD_FREE;
+    r.minerThreadId = minerThreadId;
+    r.nonce = nonce;
+    r.epoch = epoch;
+    r.foundAtMs = nowMs();
+    copyField(r.workHash, sizeof(r.workHash), workHash);
+    copyField(r.url, sizeof(r.url), url);
+    r.state = RECORD_QUEUED;
+    return slot;
+}
+
+void journalOutcome(int64_t id, ShareOutcome outcome) {
+    std::lock_guard<std::mutex> lock(s_journalMutex);
+    if (!s_pHeader || id < 0 || id >= JOURNAL_CAPACITY)
+        return;
+    JournalRecord& r = s_pRecords[id];
+    if (r.state == RECORD_UNSENT)
+        s_unsentCount--;
+    r.state = (outcome == SHARE_UNSENT) ? RECORD_UNSENT : RECORD_DONE;
+    if (r.state == RECORD_UNSENT)
+        s_unsentCount++;
+}
+
+bool hasUnsentShares() {
+    return s_unsentCount > 0;
+}
+
+std::vector<JournaledShare> takeUnsentShares() {
+    std::lock_guard<std::mutex> lock(s_journalMutex);
+    std::vector<JournaledShare> shares;
+    if (!s_pHeader)
+        return shares;
+    for (uint32_t i = 0; i < s_pHeader->count; i++) {
+        JournalRecord& r = s_pRecords[i];
+        if (r.state != RECORD_UNSENT)
+            continue;
+        JournaledShare share;
+        share.id = i;
+        share.nonce = r.nonce;
+        share.epoch = r.epoch;
+        share.workHash = r.workHash;
+        share.url = r.url;
+        share.minerThreadId = r.minerThreadId;
+        shares.push_back(share);
+        r.state = RECORD_QUEUED;
+    }
+    s_unsentCount = 0;
+    return shares;
+}
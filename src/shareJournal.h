@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// found shares are written to a memory mapped journal before they are submitted,
+// shares whose submit failed (pool blip) or still queued when the miner stopped are submitted later
+
+enum ShareOutcome {
+    // server answered, accepted or not
+    SHARE_SUBMITTED,
+    // not sent yet, or server did not answer: replayed later
+    SHARE_UNSENT,
+    // work changed before the share could be sent
+    SHARE_STALE
+};
+
+struct JournaledShare {
+    int64_t id;
+    uint64_t nonce;
+    uint64_t epoch;
+    std::string workHash;
+    std::string url;
+    int minerThreadId;
+};
+
+/**
+ * @brief Maps the journal file (created if needed) and compacts it: only unsent shares are kept.
+ * @return false if the file cannot be mapped, shares are then not journaled.
+ */
+bool openShareJournal(const std::string& path);
+void closeShareJournal();
+
+/**
+ * @brief Appends a share about to be queued for submit, safe to call from any thread.
+ * @return id of the share for journalOutcome(), -1 if the share is not journaled.
+ */
+int64_t journalShare(uint64_t nonce, uint64_t epoch, const std::string& workHash, const std::string& url, int minerThreadId);
+
+void journalOutcome(int64_t id, ShareOutcome outcome);
+
+// cheap check, without lock
+bool hasUnsentShares();
+
+/**
+ * @brief Returns unsent shares, they are marked as queued until their next journalOutcome().
+ */
+std::vector<JournaledShare> takeUnsentShares();
@@ -0,0 +1,225 @@
+#include "submitQueue.h"
+
+#include <assert.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// bounded multi producer / multi consumer queue (D. Vyukov), push & pop never lock
+// each cell has a sequence number telling if it is free for the producer or ready for the consumer
+template <typename T>
+class BoundedQueue {
+   public:
+    explicit BoundedQueue(size_t capacity) : m_cells(new Cell[capacity]), m_mask(capacity - 1) {
+        assert(capacity >= 2 && (capacity & (capacity - 1)) == 0);
+        for (size_t i = 0; i < capacity; i++)
+            m_cells[i].seq.store(i, std::memory_order_relaxed);
+        m_enqueuePos.store(0, std::memory_order_relaxed);
+        m_dequeuePos.store(0, std::memory_order_relaxed);
+    }
+
+    bool push(T&& data) {
+        Cell* cell;
+        size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &m_cells[pos & m_mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                // full
+                return false;
+            } else {
+                pos = m_enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = std::move(data);
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& data) {
+        Cell* cell;
+        size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &m_cells[pos & m_mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                // empty
+                return false;
+            } else {
+                pos = m_dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+        data = std::move(cell->data);
+        cell->seq.store(pos + m_mask + 1, std::memory_order_release);
+        return true;
+    }
+
+   private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        T data;
+    };
+    std::unique_ptr<Cell[]> m_cells;
+    const size_t m_mask;
+    // producers & consumers on separate cache lines
+    alignas(64) std::atomic<size_t> m_enqueuePos;
+    alignas(64) std::atomic<size_t> m_dequeuePos;
+};
+
+const size_t SUBMIT_QUEUE_CAPACITY = 4096;
+// max delay before an idle worker notices a job whose wakeup it missed
+const auto WORKER_IDLE_POLL = std::chrono::milliseconds(50);
+// when other jobs are already queued behind a job, the ones queued within this delay after it
+// are handled with it, in one request. A lone job is submitted right away
+const auto COALESCE_WINDOW = std::chrono::milliseconds(20);
+const size_t MAX_COALESCED_JOBS = 16;
+
+static BoundedQueue<SubmitJob> s_priorityJobs(SUBMIT_QUEUE_CAPACITY);
+static BoundedQueue<SubmitJob> s_jobs(SUBMIT_QUEUE_CAPACITY);
+static SubmitHandler s_handler = nullptr;
+static std::vector<std::thread> s_workers;
+static std::atomic<bool> s_workersRun(false);
+
+// idle workers sleep on this, producers only notify when someone sleeps
+static std::mutex s_idleMutex;
+static std::condition_variable s_idleCv;
+static std::atomic<uint32_t> s_idleWorkers(0);
+// workers collecting jobs for a batch, idle ones are not woken up for jobs they would take
+static std::atomic<uint32_t> s_coalescingWorkers(0);
+// coalescing workers sleep on this until the end of their window, woken by each new job
+static std::condition_variable s_coalesceCv;
+static std::atomic<uint32_t> s_pushedJobs(0);
+
+// stats
+static std::atomic<uint32_t> s_pending(0);
+static std::atomic<uint32_t> s_peakPending(0);
+static std::atomic<uint32_t> s_dropped(0);
+static std::atomic<uint64_t> s_latencyTotalUs(0);
+static std::atomic<uint32_t> s_latencyCount(0);
+
+// collects the jobs queued behind the first one, then if there were some,
+// the ones queued until the coalescing window of the first one ends
+static void coalesceJobs(std::vector<SubmitJob>& jobs) {
+    auto windowEnd = jobs[0].queuedAt + COALESCE_WINDOW;
+    SubmitJob job;
+    s_coalescingWorkers++;
+    for (;;) {
+        uint32_t pushed = s_pushedJobs;
+        while (jobs.size() < MAX_COALESCED_JOBS && s_jobs.pop(job)) {
+            s_pending--;
+            jobs.push_back(std::move(job));
+        }
+        if (jobs.size() == 1 || jobs.size() >= MAX_COALESCED_JOBS || !s_workersRun) {
+            break;
+        }
+        std::unique_lock<std::mutex> lock(s_idleMutex);
+        if (!s_coalesceCv.wait_until(lock, windowEnd, [pushed] { return s_pushedJobs != pushed || !s_workersRun; })) {
+            break;
+        }
+    }
+    s_coalescingWorkers--;
+}
+
+static void submitWorkerFn() {
+    http_connection_handle_t handle = newHttpConnectionHandle();
+    std::vector<SubmitJob> jobs;
+    SubmitJob job;
+    for (;;) {
+        bool priority = s_priorityJobs.pop(job);
+        if (priority || s_jobs.pop(job)) {
+            s_pending--;
+            jobs.clear();
+            jobs.push_back(std::move(job));
+            if (!priority) {
+                coalesceJobs(jobs);
+            }
+            s_handler(handle, jobs);
+            auto now = std::chrono::steady_clock::now();
+            for (const auto& done : jobs) {
+                s_latencyTotalUs += std::chrono::duration_cast<std::chrono::microseconds>(now - done.queuedAt).count();
+                s_latencyCount++;
+            }
+            continue;
+        }
+        // queue is drained before exiting
+        if (!s_workersRun) {
+            break;
+        }
+        std::unique_lock<std::mutex> lock(s_idleMutex);
+        s_idleWorkers++;
+        s_idleCv.wait_for(lock, WORKER_IDLE_POLL, [] { return s_pending > 0 || !s_workersRun; });
+        s_idleWorkers--;
+    }
+    destroyHttpConnectionHandle(handle);
+}
+
+void startSubmitQueue(size_t nWorkers, SubmitHandler handler) {
+    assert(s_workers.empty() && nWorkers > 0);
+    s_handler = handler;
+    s_workersRun = true;
+    for (size_t i = 0; i < nWorkers; i++) {
+        s_workers.emplace_back(submitWorkerFn);
+    }
+}
+
+void stopSubmitQueue() {
+    s_workersRun = false;
+    { std::lock_guard<std::mutex> lock(s_idleMutex); }
+    s_idleCv.notify_all();
+    s_coalesceCv.notify_all();
+    for (auto& worker : s_workers) {
+        worker.join();
+    }
+    s_workers.clear();
+}
+
+bool pushSubmitJob(SubmitJob job, bool priority) {
+    job.queuedAt = std::chrono::steady_clock::now();
+    // counted before the push, so a worker never sees a job before its count
+    uint32_t pending = ++s_pending;
+    if (!(priority ? s_priorityJobs : s_jobs).push(std::move(job))) {
+        s_pending--;
+        s_dropped++;
+        return false;
+    }
+
+    uint32_t peak = s_peakPending;
+    while (pending > peak && !s_peakPending.compare_exchange_weak(peak, pending)) {
+    }
+
+    if (s_idleWorkers > 0 && (priority || s_coalescingWorkers == 0)) {
+        s_idleCv.notify_one();
+    }
+    if (!priority) {
+        s_pushedJobs++;
+        if (s_coalescingWorkers > 0) {
+            // taking the mutex makes sure a coalescing worker is either already sleeping, or will see the new count
+            { std::lock_guard<std::mutex> lock(s_idleMutex); }
+            s_coalesceCv.notify_all();
+        }
+    }
+    return true;
+}
+
+SubmitQueueStats submitQueueStats() {
+    SubmitQueueStats stats;
+    stats.pending = s_pending;
+    stats.peakPending = s_peakPending.exchange(stats.pending);
+    stats.dropped = s_dropped.exchange(0);
+    uint32_t count = s_latencyCount.exchange(0);
+    uint64_t totalUs = s_latencyTotalUs.exchange(0);
+    stats.avgLatencyMs = (count == 0) ? 0. : (totalUs / 1000.) / count;
+    return stats;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "http.h"
+
+// a found nonce waiting to be submitted
+struct SubmitJob {
+    uint64_t nonce = 0;
+    std::string workHash;
+    // pool the work comes from
+    std::string url;
+    int minerThreadId = -1;
+    // share journal record, -1 if not journaled
+    int64_t journalId = -1;
+    std::chrono::steady_clock::time_point queuedAt;
+};
+
+// called by submit workers with jobs queued close together, each worker passes its own persistent connection
+typedef void (*SubmitHandler)(http_connection_handle_t handle, const std::vector<SubmitJob>& jobs);
+
+struct SubmitQueueStats {
+    // jobs waiting for a worker
+    uint32_t pending;
+    // highest pending count since last call
+    uint32_t peakPending;
+    // jobs lost because the queue was full, since last call
+    uint32_t dropped;
+    // average time between queueing & end of submit, since last call
+    double avgLatencyMs;
+};
+
+/**
+ * @brief Starts the submit workers, must be called before any pushSubmitJob().
+ */
+void startSubmitQueue(size_t nWorkers, SubmitHandler handler);
+
+/**
+ * @brief Stops workers once queued jobs are submitted, and closes their connections.
+ */
+void stopSubmitQueue();
+
+/**
+ * @brief Queues a job without blocking (lock free), safe to call from any thread.
+ *
+ * @param priority Priority jobs (solo blocks) are submitted before the others, and never batched or delayed.
+ * @return false if the queue is full, job is dropped.
+ */
+bool pushSubmitJob(SubmitJob job, bool priority);
+
+SubmitQueueStats submitQueueStats();
@@ -0,0 +1,219 @@
+#include "tcpSocket.h"
+
+#include <errno.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+
+// max delay before a wait notices *pContinue is false
+const int TCP_POLL_MS = 100;
+
+typedef std::chrono::steady_clock::time_point Deadline;
+
+void closeSocket(socket_t sock) {
+#ifdef _WIN32
+    closesocket(sock);
+#else
+    close(sock);
+#endif
+}
+
+static void setNonBlocking(socket_t sock) {
+#ifdef _WIN32
+    u_long nonBlocking = 1;
+    ioctlsocket(sock, FIONBIO, &nonBlocking);
+#else
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+#endif
+}
+
+// last call failed only because it would have blocked (or connect is in progress)
+static bool wouldBlock() {
+#ifdef _WIN32
+    int error = WSAGetLastError();
+    return error == WSAEWOULDBLOCK || error == WSAEINPROGRESS;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS || errno == EINTR;
+#endif
+}
+
+// poll rather than select: descriptors above FD_SETSIZE (proxy server with many miners) are fine
+static bool pollSocket(socket_t sock, short events, int timeoutMs) {
+#ifdef _WIN32
+    WSAPOLLFD pfd;
+    pfd.fd = sock;
+    pfd.events = events;
+    pfd.revents = 0;
+    return WSAPoll(&pfd, 1, timeoutMs) > 0;
+#else
+    pollfd pfd;
+    pfd.fd = sock;
+    pfd.events = events;
+    pfd.revents = 0;
+    return poll(&pfd, 1, timeoutMs) > 0;
+#endif
+}
+
+bool waitReadable(socket_t sock, int timeoutMs) {
+    return pollSocket(sock, POLLIN, timeoutMs);
+}
+
+// false once deadline (if any) is reached or *pContinue is false
+static bool waitSocket(socket_t sock, short events, const Deadline* pDeadline, const std::atomic<bool>* pContinue) {
+    for (;;) {
+        if (pContinue && !*pContinue)
+            return false;
+        int waitMs = TCP_POLL_MS;
+        if (pDeadline) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(*pDeadline - std::chrono::steady_clock::now()).count();
+            if (left <= 0)
+                return false;
+            if (left < waitMs)
+                waitMs = (int)left;
+        }
+        if (pollSocket(sock, events, waitMs))
+            return true;
+    }
+}
+
+bool sendAll(socket_t sock, const char* data, size_t size, int timeoutMs, const std::atomic<bool>* pContinue) {
+#ifdef MSG_NOSIGNAL
+    const int flags = MSG_NOSIGNAL;
+#else
+    const int flags = 0;
+#endif
+    Deadline deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    while (size > 0) {
+        int n = send(sock, data, (int)std::min(size, (size_t)64 * 1024), flags);
+        if (n < 0 && wouldBlock()) {
+            if (!waitSocket(sock, POLLOUT, (timeoutMs >= 0) ? &deadline : nullptr, pContinue))
+                return false;
+            continue;
+        }
+        if (n <= 0)
+            return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool receiveSome(socket_t sock, std::string& buffer) {
+    char chunk[4096];
+    int n = recv(sock, chunk, sizeof(chunk), 0);
+    if (n < 0 && wouldBlock())
+        return true;
+    if (n <= 0)
+        return false;
+    buffer.append(chunk, n);
+    return true;
+}
+
+// requests are small, send them right away
+static void setNoDelay(socket_t sock) {
+    int noDelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+}
+
+// result of a non-blocking connect, once the socket is writable
+static bool connected(socket_t sock) {
+    int error = 0;
+    socklen_t errorLen = sizeof(error);
+    return getsockopt(sock, SOL_SOCKET, SO_ERROR, (char*)&error, &errorLen) == 0 && error == 0;
+}
+
+socket_t connectTcp(const std::string& host, const std::string& port, std::string& error,
+                    int timeoutMs, const std::atomic<bool>* pContinue) {
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addrs = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs) != 0) {
+        error = "cannot resolve " + host;
+        return INVALID_SOCKET;
+    }
+    // one deadline for all addresses of host: a host dropping packets must not stall its caller
+    Deadline deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    const Deadline* pDeadline = (timeoutMs >= 0) ? &deadline : nullptr;
+    socket_t sock = INVALID_SOCKET;
+    for (addrinfo* a = addrs; a && sock == INVALID_SOCKET; a = a->ai_next) {
+        sock = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (sock == INVALID_SOCKET)
+            continue;
+        setNonBlocking(sock);
+        bool ok = connect(sock, a->ai_addr, (int)a->ai_addrlen) == 0 ||
+                  (wouldBlock() && waitSocket(sock, POLLOUT, pDeadline, pContinue) && connected(sock));
+        if (!ok) {
+            closeSocket(sock);
+            sock = INVALID_SOCKET;
+        }
+    }
+    freeaddrinfo(addrs);
+    if (sock == INVALID_SOCKET) {
+        error = "cannot connect to " + host + ":" + port;
+        return INVALID_SOCKET;
+    }
+    setNoDelay(sock);
+    return sock;
+}
+
+socket_t listenTcp(const std::string& address, uint16_t port, std::string& error) {
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) {
+        error = "invalid listen address " + address;
+        return INVALID_SOCKET;
+    }
+    socket_t sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) {
+        error = "cannot create socket";
+        return INVALID_SOCKET;
+    }
+    // restarting the miner must not wait for old connections to time out
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+
+    if (bind(sock, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(sock, SOMAXCONN) != 0) {
+        error = "cannot listen on " + address + ":" + std::to_string(port);
+        closeSocket(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+uint16_t localPort(socket_t sock) {
+    sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+    if (getsockname(sock, (sockaddr*)&addr, &addrLen) != 0)
+        return 0;
+    return ntohs(addr.sin_port);
+}
+
+socket_t acceptTcp(socket_t listenSock, std::string& peer) {
+    sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+    socket_t sock = accept(listenSock, (sockaddr*)&addr, &addrLen);
+    if (sock == INVALID_SOCKET)
+        return INVALID_SOCKET;
+    char ip[INET_ADDRSTRLEN] = {0};
+    inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+    peer = std::string(ip) + ":" + std::to_string(ntohs(addr.sin_port));
+    setNonBlocking(sock);
+    setNoDelay(sock);
+    return sock;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+// plain tcp helpers, for the websocket client, the keep-alive http client & the proxy server
+// on windows, winsock is initialized by curl_global_init()
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET socket_t;
+#else
+typedef int socket_t;
+const socket_t INVALID_SOCKET = -1;
+#endif
+
+// connected & accepted sockets are non-blocking, connect and send wait at most timeoutMs (< 0: no limit)
+// and give up as soon as *pContinue is false
+const int TCP_CONNECT_TIMEOUT_MS = 10 * 1000;
+const int TCP_SEND_TIMEOUT_MS = 30 * 1000;
+
+void closeSocket(socket_t sock);
+bool sendAll(socket_t sock, const char* data, size_t size,
+             int timeoutMs = TCP_SEND_TIMEOUT_MS, const std::atomic<bool>* pContinue = nullptr);
+
+// false on timeout or error
+bool waitReadable(socket_t sock, int timeoutMs);
+
+// appends received bytes to buffer (maybe none), false if connection is closed
+bool receiveSome(socket_t sock, std::string& buffer);
+
+// host name resolution itself is not bounded by timeoutMs
+socket_t connectTcp(const std::string& host, const std::string& port, std::string& error,
+                    int timeoutMs = TCP_CONNECT_TIMEOUT_MS, const std::atomic<bool>* pContinue = nullptr);
+
+// listens on an ipv4 address (0.0.0.0: all interfaces), port 0 picks a free port
+socket_t listenTcp(const std::string& address, uint16_t port, std::string& error);
+uint16_t localPort(socket_t sock);
+
+// peer receives the client address
+socket_t acceptTcp(socket_t listenSock, std::string& peer);
@@ -3,10 +3,28 @@
 #include <assert.h>
 #include <inttypes.h>
 
+#include <rapidjson/document.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
 #include "../phc-winner-argon2/src/core.h"
 #include "hex_encode_utils.h"
+#include "http.h"
 #include "miner.h"
+#include "miningConfig.h"
+#include "proxyServer.h"
+#include "tcpSocket.h"
 #include "timer.h"
+#include "updateThread.h"
 
 #define VERBOSE_TESTS (0)
 
@@ -379,4 +397,419 @@ bool testAquaHashing() {
     }
 
     return true;
-}
\ No newline at end of file
+}
+
+// stand-in node / pool for benchmarkHttp & testProxyServer, respond gives the body answering a request body
+typedef std::function<std::string(const std::string&)> StandInHandler;
+
+struct StandInServer {
+    socket_t listenSock = INVALID_SOCKET;
+    std::atomic<bool> run{false};
+    std::thread acceptThread;
+    std::string url;
+};
+
+// answers every request of a keep-alive connection, until the server stops
+static void standInConnectionFn(socket_t sock, StandInHandler respond, const std::atomic<bool>* pRun) {
+    const std::string CONTENT_LENGTH = "Content-Length: ";
+
+    std::string buffer;
+    while (*pRun) {
+        size_t headersEnd = buffer.find("\r\n\r\n");
+        size_t length = buffer.find(CONTENT_LENGTH);
+        size_t bodySize = (headersEnd == std::string::npos || length == std::string::npos || length > headersEnd) ?
+            std::string::npos :
+            (size_t)atol(buffer.c_str() + length + CONTENT_LENGTH.size());
+        if (bodySize == std::string::npos || buffer.size() < headersEnd + 4 + bodySize) {
+            if (waitReadable(sock, 100) && !receiveSome(sock, buffer))
+                break;
+            continue;
+        }
+        std::string body = respond(buffer.substr(headersEnd + 4, bodySize));
+        buffer.erase(0, headersEnd + 4 + bodySize);
+        std::string response =
+            "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: " +
+            std::to_string(body.size()) + "\r\n\r\n" + body;
+        if (!sendAll(sock, response.c_str(), response.size()))
+            break;
+    }
+    closeSocket(sock);
+}
+
+static bool startStandIn(StandInServer& server, StandInHandler respond) {
+    std::string error;
+    server.listenSock = listenTcp("127.0.0.1", 0, error);
+    if (server.listenSock == INVALID_SOCKET) {
+        printf("Error: %s\n", error.c_str());
+        return false;
+    }
+    server.url = "http://127.0.0.1:" + std::to_string(localPort(server.listenSock)) + "/";
+    server.run = true;
+    server.acceptThread = std::thread([&server, respond] {
+        std::vector<std::thread> connections;
+        while (server.run) {
+            if (!waitReadable(server.listenSock, 100))
+                continue;
+            std::string peer;
+            socket_t sock = acceptTcp(server.listenSock, peer);
+            if (sock != INVALID_SOCKET)
+                connections.emplace_back(standInConnectionFn, sock, respond, &server.run);
+        }
+        for (auto& t : connections)
+            t.join();
+    });
+    return true;
+}
+
+static void stopStandIn(StandInServer& server) {
+    if (!server.run)
+        return;
+    server.run = false;
+    server.acceptThread.join();
+    closeSocket(server.listenSock);
+    server.listenSock = INVALID_SOCKET;
+}
+
+// node dropping packets (TEST-NET-1 address, never routed): the keep-alive client
+// must give up at the request timeout, or as soon as the request is aborted
+static bool checkUnreachableNode(const std::string& request, const std::vector<std::string>& headers) {
+    const std::string URL = "http://192.0.2.1:8080/";
+    const long TIMEOUT_MS = 1000;
+    const int ABORT_MS = 300;
+    // scheduling & poll slices
+    const double SLACK_MS = 300;
+
+    setCurlOnly(false);
+    http_connection_handle_t handle = newHttpConnectionHandle();
+    std::string response;
+
+    auto t0 = std::chrono::steady_clock::now();
+    bool answered = httpPost(handle, URL, request, response, &headers, nullptr, TIMEOUT_MS);
+    double timeoutMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+    std::atomic<bool> run(true);
+    std::thread aborter([&] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(ABORT_MS));
+        run = false;
+    });
+    t0 = std::chrono::steady_clock::now();
+    answered = httpPost(handle, URL, request, response, &headers, nullptr, 0, &run) || answered;
+    double abortMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    aborter.join();
+    destroyHttpConnectionHandle(handle);
+
+    bool ok = !answered && timeoutMs < TIMEOUT_MS + SLACK_MS && abortMs < ABORT_MS + SLACK_MS;
+    printf("unreachable node %s: %ldms timeout -> %.0fms, abort after %dms -> %.0fms : %s\n",
+           URL.c_str(), TIMEOUT_MS, timeoutMs, ABORT_MS, abortMs, ok ? "OK" : "FAILED");
+    return ok;
+}
+
+bool benchmarkHttp() {
+    const int N_REQUESTS = 2000;
+    const int N_WARMUP = 50;
+
+    // same getWork response to every request
+    const std::string BODY =
+        "{\"jsonrpc\":\"2.0\",\"id\":1,\"result\":["
+        "\"0x1f0e3dad99908345f7439f8ffabdffc4ed7d5b8b8a7f1e07b8c1d3c0a6c2d4e1\","
+        "\"0x0000000000000000000000000000000000000000000000000000000000000000\","
+        "\"0x0000000112e0be826d694b2e62d01511f12a6061fbaec8bc02357593e70e52ba\"]}";
+    StandInServer server;
+    if (!startStandIn(server, [BODY](const std::string&) { return BODY; })) {
+        return false;
+    }
+    const std::string url = server.url;
+    const std::string request = "{\"jsonrpc\":\"2.0\", \"id\" : 1, \"method\" : \"aqua_getWork\", \"params\" : null}";
+    const std::vector<std::string> HTTP_HEADER = {
+        "Accept: application/json",
+        "Content-Type: application/json"};
+
+    printf("getWork latency, %d requests on one connection to %s\n", N_REQUESTS, url.c_str());
+    bool ok = true;
+    for (bool curlOnly : {true, false}) {
+        setCurlOnly(curlOnly);
+        http_connection_handle_t handle = newHttpConnectionHandle();
+        std::string response;
+        std::vector<double> latencyUs;
+        for (int i = 0; i < N_WARMUP + N_REQUESTS && ok; i++) {
+            auto t0 = std::chrono::high_resolution_clock::now();
+            ok = httpPost(handle, url, request, response, &HTTP_HEADER) && response.size();
+            auto t1 = std::chrono::high_resolution_clock::now();
+            if (i >= N_WARMUP)
+                latencyUs.push_back(std::chrono::duration<double, std::micro>(t1 - t0).count());
+        }
+        destroyHttpConnectionHandle(handle);
+        if (!ok) {
+            printf("Error: %s request failed\n", curlOnly ? "libcurl" : "keep-alive");
+            break;
+        }
+
+        std::sort(latencyUs.begin(), latencyUs.end());
+        double total = 0;
+        for (double us : latencyUs)
+            total += us;
+        printf("%-10s : avg %7.1fus | p50 %7.1fus | p99 %7.1fus | max %7.1fus\n",
+               curlOnly ? "libcurl" : "keep-alive",
+               total / latencyUs.size(),
+               latencyUs[latencyUs.size() / 2],
+               latencyUs[latencyUs.size() * 99 / 100],
+               latencyUs.back());
+    }
+    if (ok) {
+        ok = checkUnreachableNode(request, HTTP_HEADER);
+    }
+
+    stopStandIn(server);
+    return ok;
+}
+
+// id of a json rpc call, as it is written back in its response
+static std::string rpcId(const rapidjson::Value& call) {
+    if (call.IsObject() && call.HasMember("id") && call["id"].IsInt64())
+        return std::to_string(call["id"].GetInt64());
+    return "null";
+}
+
+static std::string rpcToJson(const rapidjson::Value& value) {
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    value.Accept(writer);
+    return buffer.GetString();
+}
+
+// answers a json rpc call or batch, answerCall gives the response of one call
+static std::string answerRpc(const std::string& body, const std::function<std::string(const rapidjson::Value&)>& answerCall) {
+    rapidjson::Document doc;
+    doc.Parse(body.c_str());
+    if (!doc.IsArray())
+        return answerCall(doc);
+    std::string responses = "[";
+    for (const auto& call : doc.GetArray()) {
+        responses += (responses.size() > 1 ? "," : "") + answerCall(call);
+    }
+    return responses + "]";
+}
+
+static std::string callMethod(const rapidjson::Value& call) {
+    if (!call.IsObject() || !call.HasMember("method") || !call["method"].IsString())
+        return "";
+    return call["method"].GetString();
+}
+
+// header hash of a getWork response, empty if there is none
+static std::string workHashOf(const std::string& response) {
+    rapidjson::Document doc;
+    doc.Parse(response.c_str());
+    if (!doc.IsObject() || !doc.HasMember("result") || !doc["result"].IsArray() || doc["result"].Size() < 3 || !doc["result"][0u].IsString())
+        return "";
+    return doc["result"][0u].GetString();
+}
+
+bool testProxyServer() {
+    const int N_CLIENTS = 8;
+    const int N_WORKS = 4;
+    // pool is polled every second at most (-r 1s), long polls of clients then return
+    const long WORK_WAIT_MS = 10 * 1000;
+    const std::string TARGET = "0x0000000112e0be826d694b2e62d01511f12a6061fbaec8bc02357593e70e52ba";
+    const std::string GETWORK = "{\"jsonrpc\":\"2.0\", \"id\" : 1, \"method\" : \"aqua_getWork\", \"params\" : null}";
+    const std::string BLOCK_INFO = "{\"jsonrpc\":\"2.0\", \"id\" : 3, \"method\" : \"aqua_getBlockByNumber\", \"params\" : [\"latest\", false]}";
+    const std::vector<std::string> HTTP_HEADER = {
+        "Accept: application/json",
+        "Content-Type: application/json"};
+
+    auto workHash = [](int n) {
+        char hash[128];
+        snprintf(hash, sizeof(hash), "0x%064x", n + 1);
+        return std::string(hash);
+    };
+    auto submitRequest = [](int id, uint64_t nonce, const std::string& hash) {
+        char request[512];
+        snprintf(request, sizeof(request),
+                 "{\"jsonrpc\":\"2.0\", \"id\" : %d, \"method\" : \"aqua_submitWork\", \"params\" : [\"0x%016" PRIx64 "\",\"%s\","
+                 "\"0x0000000000000000000000000000000000000000000000000000000000000000\"]}",
+                 id, nonce, hash.c_str());
+        return std::string(request);
+    };
+
+    // pool: serves poolWork, records submits as "hash nonce"
+    // node (-n): records every method it receives, the pool records the other ones
+    std::mutex mutex;
+    std::string poolWork = workHash(0);
+    std::multiset<std::string> poolSubmits, nodeMethods, poolOtherMethods;
+    StandInServer pool, node;
+    bool ok = startStandIn(pool, [&](const std::string& body) {
+        return answerRpc(body, [&](const rapidjson::Value& call) {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::string method = callMethod(call);
+            std::string id = rpcId(call);
+            if (method == "aqua_getWork") {
+                return "{\"jsonrpc\":\"2.0\",\"id\":" + id + ",\"result\":[\"" + poolWork +
+                       "\",\"0x0000000000000000000000000000000000000000000000000000000000000000\",\"" + TARGET + "\"]}";
+            }
+            if (method == "aqua_submitWork" && call["params"].IsArray() && call["params"].Size() >= 2) {
+                poolSubmits.insert(std::string(call["params"][1u].GetString()) + " " + call["params"][0u].GetString());
+                return "{\"jsonrpc\":\"2.0\",\"id\":" + id + ",\"result\":true}";
+            }
+            poolOtherMethods.insert(method);
+            return "{\"jsonrpc\":\"2.0\",\"id\":" + id + ",\"result\":null}";
+        });
+    });
+    ok = ok && startStandIn(node, [&](const std::string& body) {
+        return answerRpc(body, [&](const rapidjson::Value& call) {
+            std::lock_guard<std::mutex> lock(mutex);
+            nodeMethods.insert(callMethod(call));
+            return "{\"jsonrpc\":\"2.0\",\"id\":" + rpcId(call) + ",\"result\":null}";
+        });
+    });
+    if (!ok) {
+        stopStandIn(pool);
+        return false;
+    }
+
+    MiningConfig cfg = miningConfig();
+    cfg.soloMine = false;
+    cfg.getWorkUrl = pool.url;
+    cfg.fullNodeUrl = node.url;
+    cfg.refreshRateMs = 1000;
+    cfg.workWeights.clear();
+    setMiningConfig(cfg);
+    startUpdateThread();
+    if (!startProxyServer("127.0.0.1", 0)) {
+        stopUpdateThread();
+        stopStandIn(pool);
+        stopStandIn(node);
+        return false;
+    }
+    const std::string proxyUrl = "http://127.0.0.1:" + std::to_string(proxyServerPort());
+    printf("proxy test: %d clients of %s, pool %s, node %s\n", N_CLIENTS, proxyUrl.c_str(), pool.url.c_str(), node.url.c_str());
+
+    // one keep-alive connection per client, the proxy knows the work it last sent on it
+    std::vector<http_connection_handle_t> clients;
+    for (int i = 0; i < N_CLIENTS; i++) {
+        clients.push_back(newHttpConnectionHandle());
+    }
+    std::multiset<std::string> expectedSubmits;
+    double maxWorkMs = 0;
+    for (int w = 0; w < N_WORKS && ok; w++) {
+        const std::string hash = workHash(w);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            poolWork = hash;
+        }
+        auto t0 = std::chrono::steady_clock::now();
+        auto deadline = t0 + std::chrono::milliseconds(WORK_WAIT_MS);
+
+        // every client long polls until it gets the new work, then submits a share of it
+        std::vector<double> workMs(N_CLIENTS, -1);
+        std::vector<int> submitted(N_CLIENTS, 0);
+        std::vector<std::thread> threads;
+        for (int i = 0; i < N_CLIENTS; i++) {
+            threads.emplace_back([&, i] {
+                // first request has no known work, it is not a long poll
+                std::string path = (w == 0) ? "/" : "/longpoll";
+                std::string response;
+                while (std::chrono::steady_clock::now() < deadline) {
+                    long leftMs = (long)std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+                    bool answered = httpPost(clients[i], proxyUrl + path, GETWORK, response, &HTTP_HEADER, nullptr, std::max(leftMs, 1L));
+                    std::string served = answered ? workHashOf(response) : "";
+                    if (served == hash) {
+                        workMs[i] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+                        break;
+                    }
+                    // no work in the proxy yet
+                    if (served.empty())
+                        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                    else
+                        path = "/longpoll";
+                }
+                if (workMs[i] < 0)
+                    return;
+                submitted[i] = httpPost(clients[i], proxyUrl + "/", submitRequest(i, (uint64_t)(w * N_CLIENTS + i), hash),
+                                        response, &HTTP_HEADER, nullptr, WORK_WAIT_MS) &&
+                               response.find("\"result\":true") != std::string::npos;
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        for (int i = 0; i < N_CLIENTS; i++) {
+            char share[128];
+            snprintf(share, sizeof(share), "%s 0x%016" PRIx64, hash.c_str(), (uint64_t)(w * N_CLIENTS + i));
+            expectedSubmits.insert(share);
+            maxWorkMs = std::max(maxWorkMs, workMs[i]);
+            if (workMs[i] < 0 || !submitted[i]) {
+                printf("Error: client %d %s work %d\n", i, workMs[i] < 0 ? "did not get" : "could not submit a share of", w);
+                ok = false;
+            }
+        }
+
+        // mixed batch: getWork from the proxy memory, submits to the pool, block info to the node,
+        // responses in request order
+        std::string response;
+        std::string batch = "[" + GETWORK + "," + submitRequest(11, 1000 + w * 2, hash) + "," + BLOCK_INFO + "," +
+                            submitRequest(12, 1001 + w * 2, hash) + "]";
+        bool batchOk = httpPost(clients[0], proxyUrl + "/", batch, response, &HTTP_HEADER, nullptr, WORK_WAIT_MS);
+        rapidjson::Document batchResponse;
+        batchResponse.Parse(response.c_str());
+        batchOk = batchOk && batchResponse.IsArray() && batchResponse.Size() == 4 &&
+                  workHashOf(rpcToJson(batchResponse[0u])) == hash && rpcId(batchResponse[2u]) == "3";
+        for (rapidjson::SizeType n : {1u, 3u}) {
+            batchOk = batchOk && rpcId(batchResponse[n]) == (n == 1 ? "11" : "12") &&
+                      batchResponse[n].HasMember("result") && batchResponse[n]["result"].IsBool() && batchResponse[n]["result"].GetBool();
+        }
+        for (int n = 0; n < 2; n++) {
+            char share[128];
+            snprintf(share, sizeof(share), "%s 0x%016" PRIx64, hash.c_str(), (uint64_t)(1000 + w * 2 + n));
+            expectedSubmits.insert(share);
+        }
+        if (!batchOk) {
+            printf("Error: batch of work %d not split / answered in order: %s\n", w, response.c_str());
+            ok = false;
+        }
+        printf("work %d reached %d clients in %.0fms max\n", w, N_CLIENTS, *std::max_element(workMs.begin(), workMs.end()));
+    }
+
+    // block info goes to the node, methods outside of the allowlist go nowhere
+    std::string response;
+    size_t nodeCalls;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        nodeCalls = nodeMethods.count("aqua_getBlockByNumber");
+    }
+    const std::string ADMIN = "{\"jsonrpc\":\"2.0\", \"id\" : 4, \"method\" : \"admin_peers\", \"params\" : []}";
+    bool blockInfoOk = httpPost(clients[0], proxyUrl + "/", BLOCK_INFO, response, &HTTP_HEADER, nullptr, WORK_WAIT_MS) &&
+                       response.find("\"result\":null") != std::string::npos;
+    bool adminRefused = httpPost(clients[0], proxyUrl + "/", ADMIN, response, &HTTP_HEADER, nullptr, WORK_WAIT_MS) &&
+                        response.find("not allowed") != std::string::npos;
+    adminRefused = adminRefused && httpPost(clients[0], proxyUrl + "/", "[" + GETWORK + "," + ADMIN + "]", response, &HTTP_HEADER, nullptr, WORK_WAIT_MS) &&
+                   response.find("not allowed") != std::string::npos;
+
+    for (auto handle : clients) {
+        destroyHttpConnectionHandle(handle);
+    }
+    stopProxyServer();
+    stopUpdateThread();
+    stopStandIn(pool);
+    stopStandIn(node);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        blockInfoOk = blockInfoOk && nodeMethods.count("aqua_getBlockByNumber") > nodeCalls;
+        adminRefused = adminRefused && !nodeMethods.count("admin_peers") && !poolOtherMethods.count("admin_peers");
+        if (poolSubmits != expectedSubmits || nodeMethods.count("aqua_submitWork")) {
+            printf("Error: %u submits expected on the pool, it got %u, node got %u\n",
+                   (unsigned)expectedSubmits.size(), (unsigned)poolSubmits.size(), (unsigned)nodeMethods.count("aqua_submitWork"));
+            ok = false;
+        }
+    }
+    if (!blockInfoOk) {
+        printf("Error: block info not forwarded to the node\n");
+    }
+    if (!adminRefused) {
+        printf("Error: admin_peers was not refused\n");
+    }
+    ok = ok && blockInfoOk && adminRefused;
+    printf("proxy test: %d work changes, %u submits, new work in %.0fms max : %s\n",
+           N_WORKS, (unsigned)expectedSubmits.size(), maxWorkMs, ok ? "OK" : "FAILED");
+    return ok;
+}
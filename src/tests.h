@@ -1,3 +1,10 @@
 #pragma once
 
-bool testAquaHashing();
\ No newline at end of file
+bool testAquaHashing();
+
+// getWork latency of libcurl & of the keep-alive client, against a local stand-in node
+bool benchmarkHttp();
+
+// runs --proxy-server between local stand-in pool / node and several clients,
+// checks every work change reaches all clients & every share reaches the pool
+bool testProxyServer();
\ No newline at end of file
@@ -0,0 +1,91 @@
+#include "tuning.h"
+
+#include <stdio.h>
+
+#include <fstream>
+#include <mutex>
+#include <vector>
+
+#include "string_utils.h"
+
+extern std::string s_configDir;
+
+const std::string TUNING_FILE_NAME = "tuning.txt";
+
+// several miner threads may tune at the same time
+static std::mutex s_tuningMutex;
+
+static std::string tuningFilePath() {
+    return s_configDir + TUNING_FILE_NAME;
+}
+
+// one entry per line: key|throughput searchLocal fillJobsPerGroup finalJobsPerGroup fused finalPerNonce
+// fused & finalPerNonce are missing in entries of older versions
+static bool parseLine(const std::string& line, std::string& key, TuningParams& params) {
+    size_t sep = line.rfind('|');
+    if (sep == std::string::npos)
+        return false;
+    key = line.substr(0, sep);
+    params.fused = 0;
+    params.finalPerNonce = 0;
+    return sscanf(line.c_str() + sep + 1, "%u %u %u %u %u %u",
+                  &params.throughput,
+                  &params.searchLocal,
+                  &params.fillJobsPerGroup,
+                  &params.finalJobsPerGroup,
+                  &params.fused,
+                  &params.finalPerNonce) >= 4;
+}
+
+bool loadTuning(const std::string& key, TuningParams& params) {
+    std::lock_guard<std::mutex> lock(s_tuningMutex);
+    std::ifstream fs(tuningFilePath());
+    std::string line, lineKey;
+    TuningParams lineParams;
+    while (std::getline(fs, line)) {
+        if (parseLine(trim(line), lineKey, lineParams) && lineKey == key) {
+            params = lineParams;
+            return true;
+        }
+    }
+    return false;
+}
+
+void saveTuning(const std::string& key, const TuningParams& params) {
+    std::lock_guard<std::mutex> lock(s_tuningMutex);
+
+    // keep entries of other devices
+    std::vector<std::string> lines;
+    {
+        std::ifstream fs(tuningFilePath());
+        std::string line, lineKey;
+        TuningParams lineParams;
+        while (std::getline(fs, line)) {
+            line = trim(line);
+            if (parseLine(line, lineKey, lineParams) && lineKey != key)
+                lines.push_back(line);
+        }
+    }
+
+    char values[64];
+    snprintf(values, sizeof(values), "%u %u %u %u %u %u",
+             params.throughput,
+             params.searchLocal,
+             params.fillJobsPerGroup,
+             params.finalJobsPerGroup,
+             params.fused,
+             params.finalPerNonce);
+    lines.push_back(key + "|" + values);
+
+    std::string path = tuningFilePath();
+    std::string tmpPath = path + ".tmp";
+    {
+        std::ofstream fs(tmpPath, std::ios::trunc);
+        if (!fs.is_open())
+            return;
+        for (const auto& line : lines)
+            fs << line << std::endl;
+    }
+    remove(path.c_str());
+    rename(tmpPath.c_str(), path.c_str());
+}
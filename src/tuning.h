@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+
+// batch & work group sizes found by the autotuner for one device
+struct TuningParams {
+    // nonces per batch
+    uint32_t throughput;
+    // work items per group of the search (init) kernel
+    uint32_t searchLocal;
+    // nonces per work group of the search1 (fill) kernel
+    uint32_t fillJobsPerGroup;
+    // nonces per work group of the search2 (final) kernel
+    uint32_t finalJobsPerGroup;
+    // 1 if search_fused is faster than the 3 kernels, it then uses fillJobsPerGroup
+    uint32_t fused;
+    // 1 if search2_1w (one work item per nonce) is faster than search2, finalJobsPerGroup is then its local size
+    uint32_t finalPerNonce;
+};
+
+/**
+ * @brief Looks up tuned params in the tuning file.
+ *
+ * @param key Device identity + kernel build options, as the best sizes depend on both.
+ * @return true if an entry was found for this key.
+ */
+bool loadTuning(const std::string& key, TuningParams& params);
+
+/**
+ * @brief Adds or replaces the entry for key in the tuning file.
+ */
+void saveTuning(const std::string& key, const TuningParams& params);
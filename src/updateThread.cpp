@@ -5,11 +5,17 @@
 #include <rapidjson/document.h>
 #include <stdlib.h>
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <set>
 #include <sstream>
 #include <string>
 #include <thread>
@@ -19,6 +25,8 @@
 #include "log.h"
 #include "miner.h"
 #include "miningConfig.h"
+#include "poolFailover.h"
+#include "webSocket.h"
 
 #undef GetObject
 
@@ -32,18 +40,63 @@ const std::vector<std::string> HTTP_HEADER = {
     "Accept: application/json",
     "Content-Type: application/json"};
 
-static bool s_bUpdateThreadRun = true;
-static std::mutex s_workParams_mutex;
-static WorkParams s_workParams;
+static std::atomic<bool> s_bUpdateThreadRun(true);
+// last work received from each source, only used by the update thread of the source
+static WorkParams s_workParams[MAX_WORK_SOURCES];
+// work published to miner threads: descriptor is replaced, never modified
+// epoch is stored after the descriptor, so a new epoch always has its descriptor available
+static std::shared_ptr<const WorkDescriptor> s_work[MAX_WORK_SOURCES];
+static std::atomic<uint64_t> s_workEpoch[MAX_WORK_SOURCES];
 std::atomic<uint32_t> s_nodeReqId = {0};
 std::atomic<uint32_t> s_poolGetWorkCount = {0};  // number of succesfull getWork done so far
 
 static std::map<std::string, http_connection_handle_t> s_httpHandles;
+static std::mutex s_httpHandlesMutex;
+
+// idle / stalled miner threads sleep on this until the update thread gets work
+static std::mutex s_workNotifyMutex;
+static std::condition_variable s_workNotifyCv;
+
+// solo mining on a ws:// node: each new head wakes the update thread up
+static std::mutex s_newHeadMutex;
+static std::condition_variable s_newHeadCv;
+static std::atomic<uint32_t> s_newHeadCount(0);
 
 uint32_t getPoolGetWorkCount() {
     return s_poolGetWorkCount;
 }
 
+static void notifyWorkWaiters() {
+    // taking the mutex makes sure a waiter is either already sleeping, or will see the new value
+    { std::lock_guard<std::mutex> lock(s_workNotifyMutex); }
+    s_workNotifyCv.notify_all();
+}
+
+uint64_t waitWorkEpoch(uint64_t knownEpoch, std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(s_workNotifyMutex);
+    s_workNotifyCv.wait_for(lock, timeout, [knownEpoch] { return currentWorkEpoch() != knownEpoch; });
+    return currentWorkEpoch();
+}
+
+static bool hasAnyWork() {
+    for (size_t source = 0; source < workSourceCount(); source++) {
+        if (currentWorkEpoch(source))
+            return true;
+    }
+    return false;
+}
+
+bool waitAnyWork(std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(s_workNotifyMutex);
+    return s_workNotifyCv.wait_for(lock, timeout, hasAnyWork);
+}
+
+uint32_t waitPoolGetWork(uint32_t knownCount, std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(s_workNotifyMutex);
+    s_workNotifyCv.wait_for(lock, timeout, [knownCount] { return s_poolGetWorkCount != knownCount; });
+    return s_poolGetWorkCount;
+}
+
 // target = 2 ^ 256 / difficulty
 void computeTarget(mpz_t mpz_difficulty, mpz_t &mpz_target) {
     mpz_t mpz_numerator;
@@ -61,6 +114,7 @@ void computeDifficulty(mpz_t mpz_target, mpz_t &mpz_difficulty) {
 }
 
 http_connection_handle_t getHandle(const std::string &url) {
+    std::lock_guard<std::mutex> lock(s_httpHandlesMutex);
     if (s_httpHandles.find(url) == s_httpHandles.end()) {
         s_httpHandles.insert(std::make_pair(url, newHttpConnectionHandle()));
 #ifdef _DEBUG
@@ -70,16 +124,77 @@ http_connection_handle_t getHandle(const std::string &url) {
     return s_httpHandles[url];
 }
 
-static bool performGetWorkRequest(const std::string &nodeUrl, std::string &response) {
+// servers supporting long polling advertise the long poll url in this getWork response header
+const std::string LONG_POLL_HEADER = "X-Long-Polling";
+// server usually answers a long poll request before that, when it has no new work
+const long LONG_POLL_TIMEOUT_MS = 90 * 1000;
+// consecutive long poll errors before going back to polling
+const int LONG_POLL_MAX_FAILURES = 3;
+
+// json rpc call, over the persistent websocket for ws:// urls, else over http
+static bool nodeRpc(
+    const std::string &url,
+    const std::string &request,
+    std::string &response,
+    std::vector<std::string> *pResponseHeaders = nullptr,
+    long timeoutMs = 0) {
+    if (isWebSocketUrl(url)) {
+        return webSocketRpc(url, request, response, timeoutMs);
+    }
+    return httpPost(getHandle(url), url, request, response, &HTTP_HEADER,
+                    pResponseHeaders, timeoutMs, &s_bUpdateThreadRun);
+}
+
+// getWork buffers of each thread, reused by all of its polls so that they do not allocate
+thread_local std::string s_getWorkRequest;
+thread_local std::string s_getWorkResponse;
+thread_local std::vector<std::string> s_getWorkHeaders;
+
+static bool performGetWorkRequest(
+    const std::string &nodeUrl,
+    std::string &response,
+    std::vector<std::string> *pResponseHeaders = nullptr,
+    long timeoutMs = 0) {
     char getWorkParams[512];
     snprintf(
         getWorkParams,
         sizeof(getWorkParams),
         "{\"jsonrpc\":\"2.0\", \"id\" : %d, \"method\" : \"aqua_getWork\", \"params\" : null}",
         s_nodeReqId++);
-    return httpPost(getHandle(nodeUrl), nodeUrl, getWorkParams, response, &HTTP_HEADER);
+    s_getWorkRequest.assign(getWorkParams);
+    return nodeRpc(nodeUrl, s_getWorkRequest, response, pResponseHeaders, timeoutMs);
 }
 
+// long poll header can be a full url, or a path on the getWork server
+static std::string resolveLongPollUrl(const std::string &getWorkUrl, const std::string &longPoll) {
+    if (longPoll.compare(0, 4, "http") == 0) {
+        return longPoll;
+    }
+    size_t schemeEnd = getWorkUrl.find("://");
+    size_t hostEnd = getWorkUrl.find('/', (schemeEnd == std::string::npos) ? 0 : schemeEnd + 3);
+    std::string root = getWorkUrl.substr(0, hostEnd);
+    return (longPoll.size() && longPoll[0] == '/') ? root + longPoll : root + "/" + longPoll;
+}
+
+// polling interval when long polling is not available:
+// short right after new work, then backs off while work does not change,
+// never slower than the refresh rate asked with -r
+struct AdaptivePoll {
+    explicit AdaptivePoll(uint32_t refreshRateMs) {
+        const uint32_t MIN_INTERVAL_MS = 250;
+        maxMs = refreshRateMs;
+        minMs = std::min(std::max(refreshRateMs / 4, MIN_INTERVAL_MS), maxMs);
+        currentMs = minMs;
+    }
+    void onNewWork() {
+        currentMs = minMs;
+    }
+    void onSameWork() {
+        currentMs = std::min(currentMs * 3 / 2, maxMs);
+    }
+    uint32_t minMs, maxMs, currentMs;
+};
+
 typedef struct {
     std::string difficulty;
     std::string target;
@@ -127,79 +242,120 @@ std::string formatBlockInfo(const t_blockInfo &b) {
     return buf;
 }
 
-static bool getBlocksInfo(const std::string &nodeUrl, t_blocksInfo &result) {
-    auto getBlockJson = [&nodeUrl](std::string blockNum, t_blockInfo &res) -> bool {
-        char getPendingBlockParams[512];
-        snprintf(
-            getPendingBlockParams,
-            sizeof(getPendingBlockParams),
-            "{\"jsonrpc\":\"2.0\", \"id\" : %d, \"method\" : \"aqua_getBlockByNumber\", \"params\" : [\"%s\", false]}",
-            s_nodeReqId++,
-            blockNum.c_str());
+// block of an aqua_getBlockByNumber result
+static bool parseBlockInfo(const Value &result, t_blockInfo &res) {
+    if (!result.IsObject())
+        return false;
 
-        std::string resp;
-        if (!httpPost(getHandle(nodeUrl), nodeUrl, getPendingBlockParams, resp, &HTTP_HEADER))
-            return false;
+    // read difficulty
+    const char *DIFFICULTY = "difficulty";
+    if (!result.HasMember(DIFFICULTY)) {
+        return false;
+    }
+    mpz_t mpz_difficulty;
+    decodeHex(result[DIFFICULTY].GetString(), mpz_difficulty);
+    res.difficulty = mpzToString(mpz_difficulty);
 
-        std::vector<std::string> params;
+    // compute target from difficulty
+    mpz_t mpz_target;
+    computeTarget(mpz_difficulty, mpz_target);
+    res.target = mpzToString(mpz_target);
 
-        Document doc;
-        doc.Parse(resp.c_str());
-        if (!doc.HasMember(RESULT) || !doc[RESULT].IsObject())
-            return false;
+    const char *MINER = "miner";
+    if (result.HasMember(MINER) && result[MINER].IsString()) {
+        res.miner = result[MINER].GetString();
+    }
 
-        auto result = doc[RESULT].GetObject();
+    const char *NONCE = "nonce";
+    if (result.HasMember(NONCE) && result[NONCE].IsString()) {
+        res.nonce = result[NONCE].GetString();
+    }
 
-        // read difficulty
-        const char *DIFFICULTY = "difficulty";
-        if (!result.HasMember(DIFFICULTY)) {
-            return false;
-        }
-        mpz_t mpz_difficulty;
-        decodeHex(result[DIFFICULTY].GetString(), mpz_difficulty);
-        res.difficulty = mpzToString(mpz_difficulty);
-
-        // compute target from difficulty
-        mpz_t mpz_target;
-        computeTarget(mpz_difficulty, mpz_target);
-        res.target = mpzToString(mpz_target);
-
-        const char *MINER = "miner";
-        if (result.HasMember(MINER) && result[MINER].IsString()) {
-            res.miner = result[MINER].GetString();
-        }
+    const char *NUMBER = "number";
+    if (!result.HasMember(NUMBER)) {
+        return false;
+    }
+    res.height = decodeHex(result[NUMBER].GetString());
 
-        const char *NONCE = "nonce";
-        if (result.HasMember(NONCE) && result[NONCE].IsString()) {
-            res.nonce = result[NONCE].GetString();
-        }
+    const char *VERSION = "version";
+    if (result.HasMember(VERSION) && result[VERSION].IsInt()) {
+        res.version = result[VERSION].GetInt();
+    } else {
+        res.version = -1;
+    }
 
-        const char *NUMBER = "number";
-        if (!result.HasMember(NUMBER)) {
-            return false;
-        }
-        res.height = decodeHex(result[NUMBER].GetString());
+    return true;
+}
 
-        const char *VERSION = "version";
-        if (result.HasMember(VERSION) && result[VERSION].IsInt()) {
-            res.version = result[VERSION].GetInt();
-        } else {
-            res.version = -1;
-        }
+// servers that answered a json rpc batch with something else than an array
+static std::mutex s_noBatchUrlsMutex;
+static std::set<std::string> s_noBatchUrls;
 
-        return true;
+static bool getBlocksInfo(const std::string &nodeUrl, t_blocksInfo &result) {
+    uint32_t latestId = s_nodeReqId++;
+    uint32_t pendingId = s_nodeReqId++;
+    auto blockRequest = [](uint32_t id, const char *blockNum) -> std::string {
+        char request[512];
+        snprintf(
+            request,
+            sizeof(request),
+            "{\"jsonrpc\":\"2.0\", \"id\" : %u, \"method\" : \"aqua_getBlockByNumber\", \"params\" : [\"%s\", false]}",
+            id,
+            blockNum);
+        return request;
     };
+    std::string latestRequest = blockRequest(latestId, "latest");
+    std::string pendingRequest = blockRequest(pendingId, "pending");
 
-    if (!getBlockJson("latest", result.latest)) {
-        return false;
+    bool batch;
+    {
+        std::lock_guard<std::mutex> lock(s_noBatchUrlsMutex);
+        batch = s_noBatchUrls.count(nodeUrl) == 0;
     }
 
-    t_blockInfo pendingBlock;
-    if (!getBlockJson("pending", result.pending)) {
-        return false;
+    // both blocks in one round trip, responses can come in any order
+    if (batch) {
+        std::string resp;
+        if (!nodeRpc(nodeUrl, "[" + latestRequest + "," + pendingRequest + "]", resp))
+            return false;
+
+        Document doc;
+        doc.Parse(resp.c_str());
+        if (doc.IsArray()) {
+            bool hasLatest = false, hasPending = false;
+            for (SizeType i = 0; i < doc.Size(); i++) {
+                const Value &item = doc[i];
+                if (!item.IsObject() || !item.HasMember("id") || !item["id"].IsUint() || !item.HasMember(RESULT))
+                    continue;
+                uint32_t id = item["id"].GetUint();
+                if (id == latestId) {
+                    hasLatest = parseBlockInfo(item[RESULT], result.latest);
+                } else if (id == pendingId) {
+                    hasPending = parseBlockInfo(item[RESULT], result.pending);
+                }
+            }
+            return hasLatest && hasPending;
+        }
+
+        logLine(UPDATE_THREAD_LOG_PREFIX, "%s does not support json rpc batches, using single requests", nodeUrl.c_str());
+        std::lock_guard<std::mutex> lock(s_noBatchUrlsMutex);
+        s_noBatchUrls.insert(nodeUrl);
     }
 
-    return true;
+    auto getBlockJson = [&nodeUrl](const std::string &request, t_blockInfo &res) -> bool {
+        std::string resp;
+        if (!nodeRpc(nodeUrl, request, resp))
+            return false;
+
+        Document doc;
+        doc.Parse(resp.c_str());
+        if (!doc.IsObject() || !doc.HasMember(RESULT))
+            return false;
+        return parseBlockInfo(doc[RESULT], res);
+    };
+
+    return getBlockJson(latestRequest, result.latest) &&
+           getBlockJson(pendingRequest, result.pending);
 }
 
 static bool setCurrentWork(const Document &work, WorkParams &workParams) {
@@ -234,22 +390,33 @@ static bool setCurrentWork(const Document &work, WorkParams &workParams) {
     return true;
 }
 
-bool requestPoolParams(const MiningConfig &config, WorkParams &workParams, bool verbose) {
+// pLongPollUrl receives the long poll url advertised by the server (empty if none)
+static bool requestWork(
+    const std::string &url,
+    WorkParams &workParams,
+    bool verbose,
+    std::string *pLongPollUrl = nullptr,
+    long timeoutMs = 0) {
     // get work
-    std::string getWorkResponse;
-    bool postRequestOk = performGetWorkRequest(config.getWorkUrl, getWorkResponse);
+    std::string &getWorkResponse = s_getWorkResponse;
+    std::vector<std::string> &responseHeaders = s_getWorkHeaders;
+    bool postRequestOk = performGetWorkRequest(url, getWorkResponse, &responseHeaders, timeoutMs);
     if (!postRequestOk) {
         if (verbose)
-            logLine(UPDATE_THREAD_LOG_PREFIX, "Pool not responding (%s)", config.getWorkUrl.c_str());
+            logLine(UPDATE_THREAD_LOG_PREFIX, "Pool not responding (%s)", url.c_str());
         return false;
     }
+    if (pLongPollUrl) {
+        std::string longPoll = findHttpHeader(responseHeaders, LONG_POLL_HEADER);
+        *pLongPollUrl = longPoll.size() ? resolveLongPollUrl(url, longPoll) : "";
+    }
 
     // parse work json
     Document work;
     work.Parse(getWorkResponse.c_str());
     if (!work.IsObject()) {
         if (verbose) {
-            logLine(UPDATE_THREAD_LOG_PREFIX, "Cannot get work params from pool (%s)", config.getWorkUrl.c_str());
+            logLine(UPDATE_THREAD_LOG_PREFIX, "Cannot get work params from pool (%s)", url.c_str());
         }
         return false;
     }
@@ -257,30 +424,179 @@ bool requestPoolParams(const MiningConfig &config, WorkParams &workParams, bool
     // update current work params with the new work
     if (!setCurrentWork(work, workParams)) {
         if (verbose)
-            logLine(UPDATE_THREAD_LOG_PREFIX, "Error parsing pool work params (%s)\n%s\n", config.getWorkUrl.c_str(), getWorkResponse.c_str());
+            logLine(UPDATE_THREAD_LOG_PREFIX, "Error parsing pool work params (%s)\n%s\n", url.c_str(), getWorkResponse.c_str());
         return false;
     }
 
     return true;
 }
 
-WorkParams currentWorkParams() {
-    WorkParams ret;
-    s_workParams_mutex.lock();
-    {
-        ret = s_workParams;
+bool requestPoolParams(const MiningConfig &config, WorkParams &workParams, bool verbose) {
+    return requestWork(config.getWorkUrl, workParams, verbose);
+}
+
+size_t workSourceCount() {
+    return std::max<size_t>(miningConfig().workWeights.size(), 1);
+}
+
+uint64_t currentWorkEpoch(size_t source) {
+    return s_workEpoch[source].load(std::memory_order_acquire);
+}
+
+std::shared_ptr<const WorkDescriptor> currentWork(size_t source) {
+    return std::atomic_load(&s_work[source]);
+}
+
+static std::shared_ptr<const WorkDescriptor> makeWorkDescriptor(
+    const WorkParams &work,
+    const std::string &url,
+    size_t source,
+    uint64_t epoch) {
+    auto desc = std::make_shared<WorkDescriptor>();
+    desc->epoch = epoch;
+    desc->source = (uint32_t)source;
+    desc->hash = work.hash;
+    desc->url = url;
+
+    auto headerBytes = hexToBytes(work.hash);
+    if (!headerBytes.first || headerBytes.second.size() != sizeof(desc->header)) {
+        return nullptr;
+    }
+    memcpy(desc->header, headerBytes.second.data(), sizeof(desc->header));
+
+    size_t count = (mpz_sizeinbase(work.mpz_target, 2) + 7) / 8;
+    if (count > sizeof(desc->target)) {
+        // 2^256 for difficulty 1, every hash is below
+        memset(desc->target, 0xff, sizeof(desc->target));
+    } else {
+        mpz_export(desc->target + sizeof(desc->target) - count, NULL, 1, 1, 1, 0, work.mpz_target);
+    }
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 8; j++)
+            desc->deviceTarget[i] = (desc->deviceTarget[i] << 8) | desc->target[i * 8 + j];
+    }
+    return desc;
+}
+
+static bool publishWork(const WorkParams &work, const std::string &url, size_t source = 0) {
+    auto desc = makeWorkDescriptor(work, url, source, currentWorkEpoch(source) + 1);
+    if (!desc) {
+        logLine(UPDATE_THREAD_LOG_PREFIX, "Error: invalid work hash %s", work.hash.c_str());
+        return false;
+    }
+    std::atomic_store(&s_work[source], desc);
+    s_workEpoch[source].store(desc->epoch, std::memory_order_release);
+    return true;
+}
+
+// solo with several nodes: max wait for the slowest node, the first new header does not wait for it
+const long NODE_RACE_TIMEOUT_MS = 10 * 1000;
+// a node lagging behind must not bring back the work of a previous block
+const size_t SEEN_WORK_HASHES = 16;
+static std::deque<std::string> s_seenWorkHashes;
+
+static bool isNewWorkHash(const std::string &hash) {
+    if (std::find(s_seenWorkHashes.begin(), s_seenWorkHashes.end(), hash) != s_seenWorkHashes.end()) {
+        return false;
+    }
+    s_seenWorkHashes.push_back(hash);
+    if (s_seenWorkHashes.size() > SEEN_WORK_HASHES) {
+        s_seenWorkHashes.pop_front();
+    }
+    return true;
+}
+
+// sends getWork to all nodes at once, the first node returning a new header wins
+// its work is published as soon as it arrives, newWork & workUrl receive the winner
+static bool raceWork(const std::vector<std::string> &urls, WorkParams &newWork, std::string &workUrl, bool &newBlock) {
+    std::mutex mutex;
+    bool ok = false;
+    newBlock = false;
+    std::vector<std::thread> requests;
+    for (const auto &url : urls) {
+        requests.emplace_back([&, url] {
+            WorkParams work;
+            if (!requestWork(url, work, true, nullptr, NODE_RACE_TIMEOUT_MS)) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!newBlock && isNewWorkHash(work.hash) && publishWork(work, url)) {
+                notifyWorkWaiters();
+                newBlock = true;
+                newWork = work;
+                workUrl = url;
+            } else if (!ok) {
+                newWork = work;
+                workUrl = url;
+            }
+            ok = true;
+        });
     }
-    s_workParams_mutex.unlock();
-    return ret;
+    for (auto &request : requests) {
+        request.join();
+    }
+    return ok;
+}
+
+// pool mode with several pools: max duration of a getWork, so a dead pool is detected quickly
+static long poolRequestTimeoutMs() {
+    return std::max<long>(miningConfig().refreshRateMs / 2, 2000);
 }
 
-// regularly polls the pool to get new WorkParams when block changes
-void updateThreadFn() {
+// keeps standby pool connections open & measures their health
+static bool probePool(const std::string &url) {
+    WorkParams work;
+    return requestWork(url, work, false, nullptr, poolRequestTimeoutMs());
+}
+
+// called from the websocket thread, must return quickly
+static void onNewHead() {
+    { std::lock_guard<std::mutex> lock(s_newHeadMutex); }
+    s_newHeadCount++;
+    s_newHeadCv.notify_all();
+}
+
+// gets new WorkParams when block changes
+// uses long polling if the server supports it, else polls the pool regularly
+// solo mining on a ws:// node, getWork is sent as soon as the node announces a new head
+// solo mining on several nodes, they are all asked for work at once
+// pool mining on several pools, switches to a standby pool when the active one fails
+// pool mining split between several pools (--split), each pool is a work source with its own thread
+void updateThreadFn(size_t source) {
     auto tStart = high_resolution_clock::now();
     bool solo = miningConfig().soloMine;
+    bool split = workSourceCount() > 1;
+    bool race = solo && miningConfig().workUrls.size() > 1;
+    bool failover = !solo && !split && miningConfig().workUrls.size() > 1;
+    if (failover) {
+        startPoolFailover(miningConfig().workUrls, probePool);
+    }
+
+    // long poll url, empty when not supported by server or disabled
+    std::string longPollUrl;
+    int longPollFailures = 0;
+    AdaptivePoll poll(miningConfig().refreshRateMs);
+
+    bool headsSubscribed = false;
+    for (const auto &url : miningConfig().workUrls) {
+        if (!solo || !isWebSocketUrl(url)) {
+            continue;
+        }
+        char subscribeParams[256];
+        snprintf(
+            subscribeParams,
+            sizeof(subscribeParams),
+            "{\"jsonrpc\":\"2.0\", \"id\" : %d, \"method\" : \"aqua_subscribe\", \"params\" : [\"newHeads\"]}",
+            s_nodeReqId++);
+        webSocketSubscribe(url, subscribeParams, onNewHead);
+        logLine(UPDATE_THREAD_LOG_PREFIX, "subscribing to new heads on %s", url.c_str());
+        headsSubscribed = true;
+    }
 
     while (s_bUpdateThreadRun) {
         WorkParams newWork;
+        // a head announced during the request triggers another one
+        uint32_t knownHeads = s_newHeadCount;
 
         auto tNow = high_resolution_clock::now();
         std::chrono::duration<float> durationSinceLast = tNow - tStart;
@@ -303,7 +619,52 @@ void updateThreadFn() {
         // }
 
         // call aqua_getWork on node / pool
-        bool ok = requestPoolParams(miningConfig(), newWork, true);
+        // long poll request returns when work changes (or on server timeout)
+        bool ok = false;
+        bool longPolled = false;
+        bool racedNewBlock = false;
+        size_t pool = failover ? activePool() : 0;
+        std::string workUrl = failover ? poolUrl(pool) : miningConfig().workUrls[source];
+        auto tRequest = high_resolution_clock::now();
+        if (race) {
+            ok = raceWork(miningConfig().workUrls, newWork, workUrl, racedNewBlock);
+        } else if (longPollUrl.size()) {
+            ok = longPolled = requestWork(longPollUrl, newWork, false, nullptr, LONG_POLL_TIMEOUT_MS);
+            if (ok) {
+                longPollFailures = 0;
+            } else if (++longPollFailures >= LONG_POLL_MAX_FAILURES) {
+                logLine(UPDATE_THREAD_LOG_PREFIX, "long polling failed %d times, back to regular polling", longPollFailures);
+                longPollUrl.clear();
+            }
+        }
+        if (!race && !longPolled && s_bUpdateThreadRun) {
+            std::string advertisedUrl;
+            bool canLongPoll = miningConfig().longPoll && longPollFailures < LONG_POLL_MAX_FAILURES;
+            auto getWork = [&] {
+                return requestWork(workUrl, newWork, true, canLongPoll ? &advertisedUrl : nullptr,
+                                   failover ? poolRequestTimeoutMs() : 0);
+            };
+            ok = failover ? poolRequest(pool, getWork) : getWork();
+            if (ok && advertisedUrl.size() && longPollUrl.empty()) {
+                longPollUrl = advertisedUrl;
+                logLine(UPDATE_THREAD_LOG_PREFIX, "server supports long polling (%s)", longPollUrl.c_str());
+            }
+        }
+        if (!s_bUpdateThreadRun) {
+            break;
+        }
+        bool poolChanged = failover && activePool() != pool;
+        if (poolChanged) {
+            longPollUrl.clear();
+            longPollFailures = 0;
+        }
+        if (!ok && failover && (poolChanged || !allPoolsDown())) {
+            // retry on the new pool right away, or give the active pool one more chance
+            if (!poolChanged) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(poll.minMs));
+            }
+            continue;
+        }
         if (!ok) {
             const auto POOL_ERROR_WAIT_N_SECONDS = 30;
             logLine(UPDATE_THREAD_LOG_PREFIX, "problem getting new work, retrying in %ds",
@@ -316,18 +677,25 @@ void updateThreadFn() {
                 s_poolGetWorkCount++;
             }
             // we have new work (a new block)
-            if (s_workParams.hash != newWork.hash) {
-                // update miner params, must be done first, as quick as possible
-                s_workParams_mutex.lock();
-                {
-                    s_workParams = newWork;
-                }
-                s_workParams_mutex.unlock();
+            bool newBlock = race ? racedNewBlock : s_workParams[source].hash != newWork.hash && publishWork(newWork, workUrl, source);
+            if (newBlock || !solo) {
+                notifyWorkWaiters();
+            }
+            // server answers again, shares it missed can be sent
+            replayUnsentShares();
+            if (newBlock) {
+                poll.onNewWork();
+            } else {
+                poll.onSameWork();
+            }
+            if (newBlock) {
+                // miner params were updated first, as quick as possible
+                s_workParams[source] = newWork;
 
                 // refresh latest/pending blocks info
                 auto cfg = miningConfig();
                 bool hasFullNode = cfg.fullNodeUrl.size() > 0;
-                std::string queryUrl = hasFullNode ? cfg.fullNodeUrl : cfg.getWorkUrl;
+                std::string queryUrl = (hasFullNode && !race) ? cfg.fullNodeUrl : workUrl;
 
                 // building log message
                 char header[2048] = {0};
@@ -338,6 +706,10 @@ void updateThreadFn() {
                          newWork.difficulty.c_str(),
                          miningConfig().soloMine ? "block target" : "share target",
                          newWork.target.c_str());
+                if (race || failover || split) {
+                    auto n = strlen(header);
+                    snprintf(header + n, sizeof(header) - n, "\n%-16s : %s", race ? "first node" : "pool", workUrl.c_str());
+                }
 
                 char body[2048] = {0};
                 t_blocksInfo blocksInfo;
@@ -363,29 +735,49 @@ void updateThreadFn() {
             }
         }
 
-        std::this_thread::sleep_for(std::chrono::milliseconds(miningConfig().refreshRateMs));
+        // next long poll request starts right away, unless server answers without waiting
+        // with new heads, polling only covers lost notifications
+        std::chrono::duration<float, std::milli> requestDuration = high_resolution_clock::now() - tRequest;
+        if (headsSubscribed) {
+            std::unique_lock<std::mutex> lock(s_newHeadMutex);
+            s_newHeadCv.wait_for(lock, std::chrono::milliseconds(poll.maxMs), [knownHeads] {
+                return s_newHeadCount != knownHeads || !s_bUpdateThreadRun;
+            });
+        } else if (!longPolled || requestDuration.count() < poll.minMs) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(longPolled ? poll.minMs : poll.currentMs));
+        }
     }
 
-    for (auto &it : s_httpHandles) {
-        destroyHttpConnectionHandle(it.second);
+    if (failover) {
+        stopPoolFailover();
     }
 }
 
-std::thread *s_pThread = nullptr;
+// one update thread per work source
+static std::vector<std::thread *> s_updateThreads;
 void startUpdateThread() {
-    if (s_pThread) {
+    if (s_updateThreads.size()) {
         assert(0);
         return;
     }
-    s_pThread = new std::thread(updateThreadFn);
+    for (size_t source = 0; source < workSourceCount(); source++) {
+        s_updateThreads.push_back(new std::thread(updateThreadFn, source));
+    }
 }
 
 void stopUpdateThread() {
-    if (s_pThread) {
+    if (s_updateThreads.size()) {
         assert(s_bUpdateThreadRun);
         s_bUpdateThreadRun = false;
-        s_pThread->join();
-        delete s_pThread;
+        onNewHead();
+        for (auto pThread : s_updateThreads) {
+            pThread->join();
+            delete pThread;
+        }
+        s_updateThreads.clear();
+        for (auto &it : s_httpHandles) {
+            destroyHttpConnectionHandle(it.second);
+        }
     } else {
         assert(0);
     }
@@ -6,6 +6,21 @@
 void startUpdateThread();
 void stopUpdateThread();
 
-WorkParams currentWorkParams();
+#include <chrono>
+#include <memory>
+
+// number of work sources: pools mined at the same time with --split, else 1
+size_t workSourceCount();
+// miner threads check the epoch each batch, and only load the work when it changed
+// each source has its own epochs, starting at 1 with its first work
+uint64_t currentWorkEpoch(size_t source = 0);
+std::shared_ptr<const WorkDescriptor> currentWork(size_t source = 0);
 bool requestPoolParams(const MiningConfig& config, WorkParams& workParams, bool verbose);
 uint32_t getPoolGetWorkCount();
+
+// block until work epoch / getWork count differs from the known one, or timeout
+// update thread wakes waiters as soon as it gets new work, return the current value
+uint64_t waitWorkEpoch(uint64_t knownEpoch, std::chrono::milliseconds timeout);
+uint32_t waitPoolGetWork(uint32_t knownCount, std::chrono::milliseconds timeout);
+// block until one of the work sources has work, or timeout, true if one has
+bool waitAnyWork(std::chrono::milliseconds timeout);
@@ -0,0 +1,483 @@
+#include "webSocket.h"
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#include <rapidjson/document.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "http.h"
+#include "log.h"
+#include "tcpSocket.h"
+
+#undef GetObject
+
+using namespace rapidjson;
+
+const char* WEBSOCKET_LOG_PREFIX = "WSCK";
+
+// rfc 6455 opcodes
+enum {
+    WS_OP_CONTINUATION = 0x0,
+    WS_OP_TEXT = 0x1,
+    WS_OP_BINARY = 0x2,
+    WS_OP_CLOSE = 0x8,
+    WS_OP_PING = 0x9,
+    WS_OP_PONG = 0xa
+};
+
+const char* WS_ACCEPT_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC11B65";
+const size_t WS_MAX_MESSAGE_SIZE = 16 * 1024 * 1024;
+const int WS_HANDSHAKE_TIMEOUT_MS = 10 * 1000;
+// max delay before the connection thread notices shutdown / a new subscription
+const int WS_POLL_MS = 200;
+const long WS_DEFAULT_RPC_TIMEOUT_MS = 30 * 1000;
+const int WS_RECONNECT_MIN_S = 1;
+const int WS_RECONNECT_MAX_S = 30;
+
+enum WsReceiveResult {
+    WS_MESSAGE,
+    WS_TIMEOUT,
+    WS_CLOSED
+};
+
+// socket is only read & closed by the connection thread, other threads only send
+struct WsConnection {
+    socket_t sock = INVALID_SOCKET;
+    std::mutex sendMutex;
+    // received bytes not parsed yet
+    std::string buffer;
+    // fragments of the current message
+    std::string message;
+};
+
+static std::string base64(const unsigned char* data, size_t size) {
+    std::vector<unsigned char> out(4 * ((size + 2) / 3) + 1);
+    int n = EVP_EncodeBlock(out.data(), data, (int)size);
+    return std::string((const char*)out.data(), n);
+}
+
+// ws://host[:port][/path]
+static bool parseWebSocketUrl(const std::string& url, std::string& host, std::string& port, std::string& path, std::string& error) {
+    if (url.compare(0, 6, "wss://") == 0) {
+        error = "wss:// is not supported, use a ws:// url";
+        return false;
+    }
+    if (url.compare(0, 5, "ws://") != 0) {
+        error = "not a ws:// url";
+        return false;
+    }
+    size_t hostStart = 5;
+    size_t pathStart = url.find('/', hostStart);
+    std::string hostPort = url.substr(hostStart, pathStart - hostStart);
+    path = (pathStart == std::string::npos) ? "/" : url.substr(pathStart);
+
+    // [ipv6]:port
+    size_t portSep = hostPort.rfind(':');
+    if (portSep != std::string::npos && hostPort.find(']', portSep) != std::string::npos)
+        portSep = std::string::npos;
+    host = hostPort.substr(0, portSep);
+    port = (portSep == std::string::npos) ? "80" : hostPort.substr(portSep + 1);
+    if (host.size() > 1 && host.front() == '[' && host.back() == ']')
+        host = host.substr(1, host.size() - 2);
+    if (host.empty()) {
+        error = "missing host";
+        return false;
+    }
+    return true;
+}
+
+static bool wsConnect(const std::string& url, WsConnection& conn, std::string& error) {
+    std::string host, port, path;
+    if (!parseWebSocketUrl(url, host, port, path, error))
+        return false;
+
+    socket_t sock = connectTcp(host, port, error);
+    if (sock == INVALID_SOCKET)
+        return false;
+
+    unsigned char keyBytes[16];
+    RAND_bytes(keyBytes, sizeof(keyBytes));
+    std::string key = base64(keyBytes, sizeof(keyBytes));
+
+    std::string request =
+        "GET " + path + " HTTP/1.1\r\n"
+        "Host: " + host + ":" + port + "\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: " + key + "\r\n"
+        "Sec-WebSocket-Version: 13\r\n\r\n";
+    if (!sendAll(sock, request.c_str(), request.size())) {
+        error = "cannot send handshake";
+        closeSocket(sock);
+        return false;
+    }
+
+    // read response headers, server may send frames right after them
+    std::string buffer;
+    size_t headersEnd;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(WS_HANDSHAKE_TIMEOUT_MS);
+    while ((headersEnd = buffer.find("\r\n\r\n")) == std::string::npos) {
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (remaining.count() <= 0 || !waitReadable(sock, (int)remaining.count()) || !receiveSome(sock, buffer)) {
+            error = "no handshake response";
+            closeSocket(sock);
+            return false;
+        }
+    }
+
+    std::vector<std::string> lines;
+    size_t lineStart = 0;
+    while (lineStart < headersEnd) {
+        size_t lineEnd = buffer.find("\r\n", lineStart);
+        lines.push_back(buffer.substr(lineStart, lineEnd - lineStart));
+        lineStart = lineEnd + 2;
+    }
+
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    std::string acceptKey = key + WS_ACCEPT_GUID;
+    SHA1((const unsigned char*)acceptKey.c_str(), acceptKey.size(), digest);
+    if (lines.empty() || lines[0].find(" 101") == std::string::npos ||
+        findHttpHeader(lines, "Sec-WebSocket-Accept") != base64(digest, sizeof(digest))) {
+        error = "handshake refused (" + (lines.empty() ? std::string() : lines[0]) + ")";
+        closeSocket(sock);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(conn.sendMutex);
+    conn.sock = sock;
+    conn.buffer = buffer.substr(headersEnd + 4);
+    conn.message.clear();
+    return true;
+}
+
+static void wsClose(WsConnection& conn) {
+    std::lock_guard<std::mutex> lock(conn.sendMutex);
+    if (conn.sock != INVALID_SOCKET) {
+        closeSocket(conn.sock);
+        conn.sock = INVALID_SOCKET;
+    }
+}
+
+// client frames are always masked
+static bool wsSendFrame(WsConnection& conn, int opcode, const std::string& payload) {
+    std::string frame;
+    frame += (char)(0x80 | opcode);
+    uint64_t len = payload.size();
+    if (len < 126) {
+        frame += (char)(0x80 | len);
+    } else if (len < 65536) {
+        frame += (char)(0x80 | 126);
+        for (int i = 1; i >= 0; i--)
+            frame += (char)((len >> (8 * i)) & 0xff);
+    } else {
+        frame += (char)(0x80 | 127);
+        for (int i = 7; i >= 0; i--)
+            frame += (char)((len >> (8 * i)) & 0xff);
+    }
+    unsigned char mask[4];
+    RAND_bytes(mask, sizeof(mask));
+    frame.append((const char*)mask, sizeof(mask));
+    size_t payloadStart = frame.size();
+    frame += payload;
+    for (size_t i = 0; i < len; i++)
+        frame[payloadStart + i] ^= mask[i & 3];
+
+    std::lock_guard<std::mutex> lock(conn.sendMutex);
+    return conn.sock != INVALID_SOCKET && sendAll(conn.sock, frame.c_str(), frame.size());
+}
+
+// extracts the first complete frame of buffer, false if more bytes are needed
+static bool parseFrame(std::string& buffer, bool& fin, int& opcode, std::string& payload, bool& tooLarge) {
+    const unsigned char* b = (const unsigned char*)buffer.data();
+    size_t size = buffer.size();
+    if (size < 2)
+        return false;
+    fin = (b[0] & 0x80) != 0;
+    opcode = b[0] & 0x0f;
+    bool masked = (b[1] & 0x80) != 0;
+    uint64_t len = b[1] & 0x7f;
+    size_t pos = 2;
+    if (len >= 126) {
+        size_t lenBytes = (len == 126) ? 2 : 8;
+        if (size < pos + lenBytes)
+            return false;
+        len = 0;
+        for (size_t i = 0; i < lenBytes; i++)
+            len = (len << 8) | b[pos + i];
+        pos += lenBytes;
+    }
+    if (len > WS_MAX_MESSAGE_SIZE) {
+        tooLarge = true;
+        return false;
+    }
+    unsigned char mask[4] = {0, 0, 0, 0};
+    if (masked) {
+        if (size < pos + 4)
+            return false;
+        memcpy(mask, b + pos, 4);
+        pos += 4;
+    }
+    if (size < pos + len)
+        return false;
+    payload.assign(buffer, pos, (size_t)len);
+    if (masked) {
+        for (size_t i = 0; i < len; i++)
+            payload[i] ^= mask[i & 3];
+    }
+    buffer.erase(0, pos + (size_t)len);
+    return true;
+}
+
+// waits for the next text message, answers pings & close requests
+static WsReceiveResult wsReceive(WsConnection& conn, std::string& message, int timeoutMs) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    for (;;) {
+        bool fin, tooLarge = false;
+        int opcode;
+        std::string payload;
+        while (parseFrame(conn.buffer, fin, opcode, payload, tooLarge)) {
+            switch (opcode) {
+                case WS_OP_TEXT:
+                case WS_OP_BINARY:
+                    conn.message = payload;
+                    break;
+                case WS_OP_CONTINUATION:
+                    conn.message += payload;
+                    break;
+                case WS_OP_PING:
+                    wsSendFrame(conn, WS_OP_PONG, payload);
+                    continue;
+                case WS_OP_CLOSE:
+                    wsSendFrame(conn, WS_OP_CLOSE, payload.substr(0, 2));
+                    return WS_CLOSED;
+                default:
+                    continue;
+            }
+            if (conn.message.size() > WS_MAX_MESSAGE_SIZE)
+                return WS_CLOSED;
+            if (fin) {
+                message.swap(conn.message);
+                conn.message.clear();
+                return WS_MESSAGE;
+            }
+        }
+        if (tooLarge)
+            return WS_CLOSED;
+
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (remaining.count() <= 0 || !waitReadable(conn.sock, (int)remaining.count()))
+            return WS_TIMEOUT;
+        if (!receiveSome(conn.sock, conn.buffer))
+            return WS_CLOSED;
+    }
+}
+
+struct PendingCall {
+    bool done = false;
+    std::string response;
+};
+
+// one persistent connection to a node, with its connection thread
+struct NodeSocket {
+    std::string url;
+    WsConnection conn;
+    std::thread thread;
+
+    // guards everything below
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool connected = false;
+    // changes on each reconnection, calls waiting on an older connection fail
+    uint32_t connectionId = 0;
+    // calls waiting for a response, by request id
+    std::map<int64_t, PendingCall> pending;
+    std::string subscribeRequest;
+    void (*onNotify)() = nullptr;
+};
+
+static std::mutex s_socketsMutex;
+static std::map<std::string, std::unique_ptr<NodeSocket>> s_sockets;
+static std::atomic<bool> s_webSocketsRun(true);
+
+bool isWebSocketUrl(const std::string& url) {
+    return url.compare(0, 5, "ws://") == 0 || url.compare(0, 6, "wss://") == 0;
+}
+
+static void dispatchMessage(NodeSocket* s, const std::string& message, void (*onNotify)()) {
+    Document doc;
+    doc.Parse(message.c_str());
+
+    // batch response, belongs to the call waiting for one of its ids
+    if (doc.IsArray()) {
+        std::lock_guard<std::mutex> lock(s->mutex);
+        for (SizeType i = 0; i < doc.Size(); i++) {
+            if (!doc[i].IsObject() || !doc[i].HasMember("id") || !doc[i]["id"].IsInt64())
+                continue;
+            auto it = s->pending.find(doc[i]["id"].GetInt64());
+            if (it == s->pending.end())
+                continue;
+            it->second.done = true;
+            it->second.response = message;
+            s->cv.notify_all();
+            return;
+        }
+        return;
+    }
+    if (!doc.IsObject())
+        return;
+
+    // subscription notification: {"method":"aqua_subscription","params":{...}}
+    const char* METHOD = "method";
+    if (doc.HasMember(METHOD) && doc[METHOD].IsString() && strstr(doc[METHOD].GetString(), "_subscription")) {
+        if (onNotify)
+            onNotify();
+        return;
+    }
+
+    // response, responses nobody waits for anymore are dropped
+    const char* ID = "id";
+    if (doc.HasMember(ID) && doc[ID].IsInt64()) {
+        std::lock_guard<std::mutex> lock(s->mutex);
+        auto it = s->pending.find(doc[ID].GetInt64());
+        if (it == s->pending.end())
+            return;
+        it->second.done = true;
+        it->second.response = message;
+        s->cv.notify_all();
+    }
+}
+
+static void connectionThreadFn(NodeSocket* s) {
+    int retryS = WS_RECONNECT_MIN_S;
+    while (s_webSocketsRun) {
+        std::string error;
+        if (!wsConnect(s->url, s->conn, error)) {
+            logLine(WEBSOCKET_LOG_PREFIX, "cannot connect to %s (%s), retrying in %ds", s->url.c_str(), error.c_str(), retryS);
+            std::unique_lock<std::mutex> lock(s->mutex);
+            s->cv.wait_for(lock, std::chrono::seconds(retryS), [] { return !s_webSocketsRun; });
+            retryS = std::min(retryS * 2, WS_RECONNECT_MAX_S);
+            continue;
+        }
+        retryS = WS_RECONNECT_MIN_S;
+        logLine(WEBSOCKET_LOG_PREFIX, "connected to %s", s->url.c_str());
+        {
+            std::lock_guard<std::mutex> lock(s->mutex);
+            s->connected = true;
+            s->connectionId++;
+        }
+        s->cv.notify_all();
+
+        bool subscribed = false;
+        while (s_webSocketsRun) {
+            std::string subscribeRequest;
+            void (*onNotify)() = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(s->mutex);
+                subscribeRequest = s->subscribeRequest;
+                onNotify = s->onNotify;
+            }
+            // subscriptions do not survive the connection, (re)subscribe & signal possibly missed notifications
+            if (!subscribed && subscribeRequest.size()) {
+                if (!wsSendFrame(s->conn, WS_OP_TEXT, subscribeRequest))
+                    break;
+                subscribed = true;
+                onNotify();
+            }
+
+            std::string message;
+            WsReceiveResult res = wsReceive(s->conn, message, WS_POLL_MS);
+            if (res == WS_CLOSED)
+                break;
+            if (res == WS_MESSAGE)
+                dispatchMessage(s, message, onNotify);
+        }
+
+        wsClose(s->conn);
+        {
+            std::lock_guard<std::mutex> lock(s->mutex);
+            s->connected = false;
+        }
+        s->cv.notify_all();
+        if (s_webSocketsRun) {
+            logLine(WEBSOCKET_LOG_PREFIX, "connection to %s lost, reconnecting", s->url.c_str());
+        }
+    }
+}
+
+// connection of url, created on first use
+static NodeSocket* nodeSocket(const std::string& url) {
+    std::lock_guard<std::mutex> lock(s_socketsMutex);
+    auto& s = s_sockets[url];
+    if (!s) {
+        s.reset(new NodeSocket());
+        s->url = url;
+        s->thread = std::thread(connectionThreadFn, s.get());
+    }
+    return s.get();
+}
+
+bool webSocketRpc(const std::string& url, const std::string& request, std::string& response, long timeoutMs) {
+    Document doc;
+    doc.Parse(request.c_str());
+    // a batch is waited for by the id of its first call
+    const Value& call = (doc.IsArray() && doc.Size() > 0) ? doc[SizeType(0)] : doc;
+    if (!call.IsObject() || !call.HasMember("id") || !call["id"].IsInt64())
+        return false;
+    int64_t id = call["id"].GetInt64();
+
+    NodeSocket* s = nodeSocket(url);
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(timeoutMs > 0 ? timeoutMs : WS_DEFAULT_RPC_TIMEOUT_MS);
+
+    std::unique_lock<std::mutex> lock(s->mutex);
+    s->cv.wait_until(lock, deadline, [s] { return s->connected || !s_webSocketsRun; });
+    if (!s->connected || !s_webSocketsRun || s->pending.count(id))
+        return false;
+    uint32_t connectionId = s->connectionId;
+    auto it = s->pending.emplace(id, PendingCall()).first;
+
+    lock.unlock();
+    bool sent = wsSendFrame(s->conn, WS_OP_TEXT, request);
+    lock.lock();
+
+    if (sent) {
+        s->cv.wait_until(lock, deadline, [&] {
+            return it->second.done || !s->connected || s->connectionId != connectionId || !s_webSocketsRun;
+        });
+    }
+    bool ok = it->second.done;
+    if (ok)
+        response.swap(it->second.response);
+    s->pending.erase(it);
+    return ok;
+}
+
+void webSocketSubscribe(const std::string& url, const std::string& subscribeRequest, void (*onNotify)()) {
+    NodeSocket* s = nodeSocket(url);
+    std::lock_guard<std::mutex> lock(s->mutex);
+    s->subscribeRequest = subscribeRequest;
+    s->onNotify = onNotify;
+}
+
+void closeWebSockets() {
+    s_webSocketsRun = false;
+    std::lock_guard<std::mutex> lock(s_socketsMutex);
+    for (auto& it : s_sockets) {
+        NodeSocket* s = it.second.get();
+        { std::lock_guard<std::mutex> socketLock(s->mutex); }
+        s->cv.notify_all();
+        s->thread.join();
+    }
+    s_sockets.clear();
+}
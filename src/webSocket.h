@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string>
+
+// json rpc over persistent websocket connections (ws:// node urls)
+// one connection per url, shared by all threads, reconnected automatically when lost
+
+bool isWebSocketUrl(const std::string& url);
+
+/**
+ * @brief Sends a json rpc request on the connection of url, and waits for the response with the same id.
+ *
+ * request can be a batch (array), its response is the array holding the id of its first call.
+ *
+ * @param timeoutMs max wait for connection & response, 0 means default timeout.
+ * @return false if not connected, on send error, or if no response arrived in time.
+ */
+bool webSocketRpc(const std::string& url, const std::string& request, std::string& response, long timeoutMs = 0);
+
+/**
+ * @brief Sends subscribeRequest on each (re)connection to url.
+ *
+ * onNotify is called from the connection thread after each subscription and for each notification,
+ * it must return quickly and not call webSocketRpc() itself.
+ */
+void webSocketSubscribe(const std::string& url, const std::string& subscribeRequest, void (*onNotify)());
+
+/**
+ * @brief Closes all connections, must be called once every webSocketRpc() call has returned.
+ */
+void closeWebSockets();